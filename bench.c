@@ -0,0 +1,276 @@
+// Benchmark harness: times the reader, the compiler and the VM on a set of
+// generated workloads and writes the results as JSON, to stdout or to the
+// file named by its only argument. Run it with `make bench`.
+//
+// For each workload it reports:
+//
+//   parse_ns_per_byte : mpc_parse() of the whole input, per input byte;
+//   read_ns_per_node  : the same run, per lval_t node read. The reader
+//                       builds values while parsing, so there is no
+//                       separate pass to time;
+//   eval_ns_per_op    : lval_compile() and vm_run(), per operand that an
+//                       operator is applied to.
+//
+// The peak RSS of the whole run is reported once, at the end.
+#define _POSIX_C_SOURCE 200809L
+#define LISPY_NO_MAIN
+
+#include <time.h>
+#include <sys/resource.h>
+#include "parsing.c"
+
+/* Typedefs
+ * -------------------------------------------------------------------------- */
+// A growable string the workloads are generated into.
+typedef struct text {
+        char *s;
+        size_t len;
+        size_t cap;
+} text_t;
+
+typedef struct workload {
+        const char *name;
+        void (*gen)(text_t *t);
+} workload_t;
+
+// Each measurement is repeated until it has taken at least this long.
+#define BENCH_MIN_NS 200000000.0
+
+/* Private routine prototypes
+ * -------------------------------------------------------------------------- */
+static void text_put(text_t *t, const char *s);
+static void gen_wide(text_t *t);
+static void gen_deep(text_t *t);
+static void gen_numbers(text_t *t);
+static void gen_symbols(text_t *t);
+static double now_ns(void);
+static void count_nodes(lval_t *v, long *nodes, long *ops);
+static void bench_workload(FILE *out, const workload_t *w, bool last);
+
+/* Workloads
+ * -------------------------------------------------------------------------- */
+static void
+text_put(text_t *t, const char *s)
+{
+        size_t n = strlen(s);
+
+        if (t->len + n + 1 > t->cap) {
+                t->cap = t->cap * 2 > t->len + n + 1 ? t->cap * 2 : t->len + n + 1;
+                t->s = realloc(t->s, t->cap);
+        }
+
+        memcpy(t->s + t->len, s, n + 1);
+        t->len += n;
+}
+
+// One operator applied to many small numbers.
+static void
+gen_wide(text_t *t)
+{
+        char num[32];
+
+        text_put(t, "(+");
+        for (int i = 0; i < 100000; i++) {
+                snprintf(num, sizeof(num), " %d", i % 1000);
+                text_put(t, num);
+        }
+        text_put(t, ")");
+}
+
+// Nested applications, far deeper than the C stack would take were the
+// reader and the evaluator to recurse, and about as long as the others.
+static void
+gen_deep(text_t *t)
+{
+        enum { DEPTH = 50000 };
+
+        for (int i = 0; i < DEPTH; i++) {
+                text_put(t, "(+ 1 ");
+        }
+        text_put(t, "0");
+        for (int i = 0; i < DEPTH; i++) {
+                text_put(t, ")");
+        }
+}
+
+// Literals far beyond the fixnum range, read and added as bignums.
+static void
+gen_numbers(text_t *t)
+{
+        char num[128];
+
+        text_put(t, "(+");
+        for (int i = 0; i < 2000; i++) {
+                int n = snprintf(num, sizeof(num), " %d", i + 1);
+                for (; n < 101; n++) {
+                        num[n] = '0' + (i * 7 + n) % 10;
+                }
+                num[n] = '\0';
+                text_put(t, num);
+        }
+        text_put(t, ")");
+}
+
+// Many small applications, so that most nodes are operator symbols.
+static void
+gen_symbols(text_t *t)
+{
+        static const char *forms[] = {
+                " (* (+ 1 2) (- 3 4))",
+                " (- (/ 8 2) (* 2 2))",
+                " (+ (- 9) (* 1 (/ 6 3)))"
+        };
+
+        text_put(t, "(+");
+        for (int i = 0; i < 30000; i++) {
+                text_put(t, forms[i % 3]);
+        }
+        text_put(t, ")");
+}
+
+static const workload_t workloads[] = {
+        { "wide", gen_wide },
+        { "deep", gen_deep },
+        { "numbers", gen_numbers },
+        { "symbols", gen_symbols }
+};
+
+/* Measurement
+ * -------------------------------------------------------------------------- */
+static double
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Counts the values in v, and the operands of the operators it applies.
+// It keeps a stack of its own, as the deep workload is too deep to
+// recurse over.
+static void
+count_nodes(lval_t *v, long *nodes, long *ops)
+{
+        frames_t frames = { NULL, 0, 0 };
+
+        for (;;) {
+                (*nodes)++;
+
+                if (lval_type(v) == LVAL_SEXPR) {
+                        if (v->cnt > 1) {
+                                *ops += v->cnt - 1;
+                        }
+                        frames_push(&frames, v);
+                }
+
+                while (frames.cnt > 0) {
+                        frame_t *f = &frames.frame[frames.cnt - 1];
+                        if (f->i < f->v->cnt) {
+                                break;
+                        }
+                        frames.cnt--;
+                }
+
+                if (frames.cnt == 0) {
+                        break;
+                }
+
+                frame_t *f = &frames.frame[frames.cnt - 1];
+                v = f->v->cell[f->i++];
+        }
+
+        free(frames.frame);
+}
+
+static void
+bench_workload(FILE *out, const workload_t *w, bool last)
+{
+        text_t t = { NULL, 0, 0 };
+        w->gen(&t);
+
+        // Values read stay in read_arena for evaluation; anything
+        // evaluation allocates goes into eval_arena, reset every run.
+        arena_t *read_arena = arena_new();
+        arena_t *eval_arena = arena_new();
+        reader_t *reader = reader_new(read_arena);
+        mpc_result_t r;
+        long runs;
+        double start, parse_ns, eval_ns;
+
+        runs = 0;
+        start = now_ns();
+        do {
+                arena_reset(read_arena);
+                if (!mpc_parse(w->name, t.s, reader->lispy, &r)) {
+                        mpc_err_print(r.error);
+                        exit(1);
+                }
+                runs++;
+        } while (now_ns() - start < BENCH_MIN_NS);
+        parse_ns = (now_ns() - start) / runs;
+
+        lval_t *v = r.output;
+        long nodes = 0;
+        long ops = 0;
+        count_nodes(v, &nodes, &ops);
+
+        // Workloads are meant to evaluate cleanly; an error would mean
+        // timing the wrong thing.
+        lval_t *result = lval_eval(eval_arena, v);
+        if (lval_type(result) == LVAL_ERR) {
+                lval_println(result);
+                exit(1);
+        }
+
+        runs = 0;
+        start = now_ns();
+        do {
+                arena_reset(eval_arena);
+                lval_eval(eval_arena, v);
+                runs++;
+        } while (now_ns() - start < BENCH_MIN_NS);
+        eval_ns = (now_ns() - start) / runs;
+
+        fprintf(out,
+                "    {\"name\": \"%s\", \"bytes\": %zu, \"nodes\": %ld, "
+                "\"ops\": %ld,\n"
+                "     \"parse_ns_per_byte\": %.3f, "
+                "\"read_ns_per_node\": %.3f, \"eval_ns_per_op\": %.3f}%s\n",
+                w->name, t.len, nodes, ops,
+                parse_ns / t.len, parse_ns / nodes,
+                ops > 0 ? eval_ns / ops : 0.0, last ? "" : ",");
+
+        reader_del(reader);
+        arena_del(eval_arena);
+        arena_del(read_arena);
+        free(t.s);
+}
+
+/* main
+ * -------------------------------------------------------------------------- */
+int main(int argc, char** argv)
+{
+        FILE *out = stdout;
+        if (argc > 1 && (out = fopen(argv[1], "w")) == NULL) {
+                fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+                return 1;
+        }
+
+        symtab_init();
+
+        int cnt = sizeof(workloads) / sizeof(workloads[0]);
+        fprintf(out, "{\n  \"workloads\": [\n");
+        for (int i = 0; i < cnt; i++) {
+                bench_workload(out, &workloads[i], i == cnt - 1);
+        }
+
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(out, "  ],\n  \"peak_rss_kb\": %ld\n}\n", ru.ru_maxrss);
+
+        symtab_del();
+        if (out != stdout) {
+                fclose(out);
+        }
+        return 0;
+}
@@ -1,3 +1,33 @@
+/*
+** Regular files are memory mapped, and ttys
+** read a line at a time, where POSIX is
+** available.
+*/
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define MPC_USE_POSIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+/*
+** Character classes are scanned with vector
+** instructions where the target has them.
+*/
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <time.h>
 #include "mpc.h"
 
 /*
@@ -20,34 +50,176 @@ static mpc_state_t mpc_state_new(void) {
   return s;
 }
 
+/*
+** Character Classes
+**
+** `oneof` and `noneof` are compiled to a bit
+** per byte. Where the class is a handful of
+** byte ranges, runs of it are also scanned
+** for a vector at a time.
+*/
+
+enum {
+  MPC_CLASS_RANGES_MAX = 8
+};
+
+typedef struct {
+  unsigned char set[32];
+  int ranges;
+  unsigned char lo[MPC_CLASS_RANGES_MAX];
+  unsigned char hi[MPC_CLASS_RANGES_MAX];
+} mpc_class_t;
+
+static int mpc_class_has(const mpc_class_t *c, char x) {
+  return c->set[(unsigned char)x / 8] & (1 << ((unsigned char)x % 8));
+}
+
+/*
+** `oneof` never matches a NUL character and
+** `noneof` always does.
+*/
+
+static mpc_class_t *mpc_class_new(const char *s, int negate) {
+  
+  int j, k;
+  mpc_class_t *c = malloc(sizeof(mpc_class_t));
+  
+  memset(c->set, 0, 32);
+  for (j = 0; s[j]; j++) {
+    c->set[(unsigned char)s[j] / 8] |= 1 << ((unsigned char)s[j] % 8);
+  }
+  
+  if (negate) {
+    for (j = 0; j < 32; j++) { c->set[j] = ~c->set[j]; }
+  }
+  
+  c->ranges = 0;
+  for (j = 0; j < 256; j++) {
+    if (!mpc_class_has(c, (char)j)) { continue; }
+    if (c->ranges == MPC_CLASS_RANGES_MAX) { c->ranges = -1; break; }
+    for (k = j; k + 1 < 256 && mpc_class_has(c, (char)(k + 1)); k++);
+    c->lo[c->ranges] = (unsigned char)j;
+    c->hi[c->ranges] = (unsigned char)k;
+    c->ranges++;
+    j = k;
+  }
+  
+  return c;
+}
+
+static mpc_class_t *mpc_class_copy(const mpc_class_t *c) {
+  mpc_class_t *d = malloc(sizeof(mpc_class_t));
+  memcpy(d, c, sizeof(mpc_class_t));
+  return d;
+}
+
+static int mpc_class_ctz(unsigned int m) {
+#ifdef __GNUC__
+  return __builtin_ctz(m);
+#else
+  int n = 0;
+  while (!(m & 1)) { m >>= 1; n++; }
+  return n;
+#endif
+}
+
+/*
+** Returns how many of the `n` bytes at `s` are
+** in the class. A byte is in range when its
+** distance above the low end, wrapping, is at
+** most the width of the range.
+*/
+
+static long mpc_class_span(const mpc_class_t *c, const char *s, long n) {
+  
+  long j = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+  int k;
+  unsigned int m;
+#endif
+#if defined(__AVX2__)
+  __m256i x, t, in;
+  __m256i lo[MPC_CLASS_RANGES_MAX], width[MPC_CLASS_RANGES_MAX];
+#elif defined(__SSE2__)
+  __m128i x, t, in;
+  __m128i lo[MPC_CLASS_RANGES_MAX], width[MPC_CLASS_RANGES_MAX];
+#endif
+
+#if defined(__AVX2__)
+  if (c->ranges > 0) {
+    for (k = 0; k < c->ranges; k++) {
+      lo[k] = _mm256_set1_epi8((char)c->lo[k]);
+      width[k] = _mm256_set1_epi8((char)(c->hi[k] - c->lo[k]));
+    }
+    for (; j + 32 <= n; j += 32) {
+      x = _mm256_loadu_si256((const __m256i*)(s + j));
+      in = _mm256_setzero_si256();
+      for (k = 0; k < c->ranges; k++) {
+        t = _mm256_sub_epi8(x, lo[k]);
+        in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(t, width[k]), t));
+      }
+      m = (unsigned int)_mm256_movemask_epi8(in);
+      if (m != 0xFFFFFFFFu) { return j + mpc_class_ctz(~m); }
+    }
+  }
+#elif defined(__SSE2__)
+  if (c->ranges > 0) {
+    for (k = 0; k < c->ranges; k++) {
+      lo[k] = _mm_set1_epi8((char)c->lo[k]);
+      width[k] = _mm_set1_epi8((char)(c->hi[k] - c->lo[k]));
+    }
+    for (; j + 16 <= n; j += 16) {
+      x = _mm_loadu_si128((const __m128i*)(s + j));
+      in = _mm_setzero_si128();
+      for (k = 0; k < c->ranges; k++) {
+        t = _mm_sub_epi8(x, lo[k]);
+        in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(t, width[k]), t));
+      }
+      m = (unsigned int)_mm_movemask_epi8(in);
+      if (m != 0xFFFFu) { return j + mpc_class_ctz(~m); }
+    }
+  }
+#endif
+  
+  while (j < n && mpc_class_has(c, s[j])) { j++; }
+  return j;
+}
+
 /*
 ** Input Type
 */
 
 /*
-** In mpc the input type has three modes of 
-** operation: String, File and Pipe.
+** In mpc the input type has two modes of 
+** operation: String and Pipe.
 **
 ** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
+** already in a buffer and scanned through.
 ** The cursor can jump around at will making 
-** backtracking easy.
+** backtracking easy. The buffer is borrowed
+** from the caller, never copied, and its
+** length is known up front so it may contain
+** NUL characters.
 **
-** The second is a File which is also somewhat
-** easy. The contents are never loaded into 
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** Pipe covers every other stream: pipes,
+** sockets, ttys and files that cannot be
+** memory mapped. The stream is read in large
+** blocks into a window, or a line at a time
+** from a tty, and characters are then taken
+** from the window much as from a String.
 **
-** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and 
-** only support a single character lookahead at 
-** any point, when the input is marked for a 
-** potential backtracking we start buffering any 
-** input.
+** To allow backtracking the window keeps
+** everything from the lowest active mark on.
+** Only input before both that mark and the
+** cursor is slid out, when the window is
+** next refilled.
 **
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** A regular file is memory mapped where it
+** can be and scanned as a String, or else read
+** as a Pipe. Either way, a file that can be
+** seeked is left positioned just after the
+** input consumed once parsing is done. A pipe
+** may have been read ahead.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -57,8 +229,7 @@ static mpc_state_t mpc_state_new(void) {
 
 enum {
   MPC_INPUT_STRING = 0,
-  MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 1
 };
 
 enum {
@@ -69,19 +240,40 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_BLOCK_SIZE = 65536
+};
+
+enum {
+  MPC_INPUT_MEMO_MIN = 64
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+typedef struct mpc_memo_t mpc_memo_t;
+
 typedef struct {
 
   int type;
   char *filename;  
   mpc_state_t state;
   
-  char *string;
+  const char *string;
+  long length;
+  int starved;
   char *buffer;
+  long buffer_pos;
+  long buffer_len;
+  long buffer_slots;
   FILE *file;
+  long file_offset;
+  int interactive;
+  int eof;
+  
+  char *mapping;
+  size_t mapping_size;
   
   int suppress;
   int backtrack;
@@ -92,43 +284,20 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  mpc_memo_t **memo;
+  long memo_pos;
+  long memo_slots;
+  
+  long allocs;
+  size_t mem_free_num;
+  unsigned short mem_free[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
-
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
-  
-  i->state = mpc_state_new();
-  
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
-  i->file = NULL;
-  
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-  
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-  
-  return i;
-}
-
 static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
+  int j;
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
   i->filename = malloc(strlen(filename) + 1);
@@ -137,11 +306,18 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   
   i->state = mpc_state_new();
   
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
+  i->string = string;
+  i->length = (long)length;
+  i->starved = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
+  i->file_offset = -1;
+  i->interactive = 0;
+  i->eof = 0;
+  i->mapping = NULL;
   
   i->suppress = 0;
   i->backtrack = 1;
@@ -151,15 +327,27 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_pos = 0;
+  i->memo_slots = 0;
+  
+  i->allocs = 0;
+  for (j = 0; j < MPC_INPUT_MEM_NUM; j++) {
+    i->mem_free[j] = (unsigned short)(MPC_INPUT_MEM_NUM - 1 - j);
+  }
+  i->mem_free_num = MPC_INPUT_MEM_NUM;
   
   return i;
 
 }
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
+  int j;
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
   i->filename = malloc(strlen(filename) + 1);
@@ -169,8 +357,21 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
+  i->starved = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = pipe;
+  i->file_offset = -1;
+#ifdef MPC_USE_POSIX
+  i->interactive = isatty(fileno(pipe));
+#else
+  i->interactive = 0;
+#endif
+  i->eof = 0;
+  i->mapping = NULL;
   
   i->suppress = 0;
   i->backtrack = 1;
@@ -180,76 +381,105 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_pos = 0;
+  i->memo_slots = 0;
+  
+  i->allocs = 0;
+  for (j = 0; j < MPC_INPUT_MEM_NUM; j++) {
+    i->mem_free[j] = (unsigned short)(MPC_INPUT_MEM_NUM - 1 - j);
+  }
+  i->mem_free_num = MPC_INPUT_MEM_NUM;
   
   return i;
   
 }
 
-static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
+/*
+** Switches an input reading a file over to
+** scanning a memory map of the rest of it, if
+** it is a regular, non-empty one.
+*/
+
+static void mpc_input_map_file(mpc_input_t *i) {
+#ifdef MPC_USE_POSIX
   
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  struct stat st;
+  char *m;
+  int fd = fileno(i->file);
   
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return; }
+  if (i->file_offset < 0 || (off_t)i->file_offset >= st.st_size) { return; }
   
-  i->string = NULL;
-  i->buffer = NULL;
-  i->file = file;
+  m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (m == MAP_FAILED) { return; }
   
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  posix_madvise(m, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->type = MPC_INPUT_STRING;
+  i->mapping = m;
+  i->mapping_size = (size_t)st.st_size;
+  i->string = m + i->file_offset;
+  i->length = (long)st.st_size - i->file_offset;
   
+#else
+  (void)i;
+#endif
+}
+
+static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
+  mpc_input_t *i = mpc_input_new_pipe(filename, file);
+  i->file_offset = ftell(file);
+  mpc_input_map_file(i);
   return i;
 }
 
+static void mpc_memo_drop(mpc_input_t *i, long pos);
+
 static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  mpc_memo_drop(i, i->memo_pos + i->memo_slots);
+  free(i->memo);
+  
+#ifdef MPC_USE_POSIX
+  if (i->mapping) { munmap(i->mapping, i->mapping_size); }
+#endif
+  if (i->file_offset >= 0) {
+    fseek(i->file, i->file_offset + i->state.pos, SEEK_SET);
+  }
+  free(i->buffer);
   
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
+/*
+** Only the start of a slot counts as a pool
+** pointer. Values that are not pointers at all,
+** such as tagged integers, must never be
+** mistaken for one.
+*/
+
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
   return
     (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t)) &&
+    ((size_t)((char*)p - (char*)(i->mem))) % sizeof(mpc_mem_t) == 0;
 }
 
+/*
+** The free blocks are kept on a stack, so that
+** taking one does not mean searching for it
+** when many are held at once by deep input.
+*/
+
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
-  
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
-  
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
-  
-  return malloc(n);
+  i->allocs++;
+  if (n > sizeof(mpc_mem_t) || i->mem_free_num == 0) { return malloc(n); }
+  return i->mem + i->mem_free[--i->mem_free_num];
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -262,13 +492,14 @@ static void mpc_free(mpc_input_t *i, void *p) {
   size_t j;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
   j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  i->mem_free[i->mem_free_num++] = (unsigned short)j;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
   char *q = NULL;
   
+  i->allocs++;
   if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
   
   if (n > sizeof(mpc_mem_t)) {
@@ -311,10 +542,6 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -332,11 +559,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);      
   }
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-  
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -346,118 +568,105 @@ static void mpc_input_rewind(mpc_input_t *i) {
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
   
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
-  
   mpc_input_unmark(i);
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_pos + i->buffer_len;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->state.pos - i->buffer_pos];
 }
 
-static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
-  if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
-  return 0;
-}
+/*
+** Reads more of a Pipe into the window, after
+** sliding out what is before both the lowest
+** mark and the cursor. Returns 0 at the end of
+** the input.
+*/
 
-static char mpc_input_getc(mpc_input_t *i) {
+static int mpc_input_buffer_fill(mpc_input_t *i) {
   
-  char c = '\0';
+  long keep, n;
+  int c;
   
-  switch (i->type) {
-    
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-    
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
-    
-    default: return c;
+  if (i->eof) { return 0; }
+  
+  keep = i->state.pos;
+  if (i->marks_num > 0 && i->marks[0].pos < keep) { keep = i->marks[0].pos; }
+  
+  n = keep - i->buffer_pos;
+  if (n > 0) {
+    memmove(i->buffer, i->buffer + n, i->buffer_len - n);
+    i->buffer_len -= n;
+    i->buffer_pos = keep;
   }
-}
-
-static char mpc_input_peekc(mpc_input_t *i) {
   
-  char c = '\0';
+  if (i->buffer_slots - i->buffer_len < MPC_INPUT_BLOCK_SIZE) {
+    i->buffer_slots = i->buffer_slots * 2 > i->buffer_len + MPC_INPUT_BLOCK_SIZE
+      ? i->buffer_slots * 2 : i->buffer_len + MPC_INPUT_BLOCK_SIZE;
+    i->buffer = realloc(i->buffer, i->buffer_slots);
+  }
   
-  switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: 
-      
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
-      
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
-    
-    case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-    
-    default: return c;
+  if (i->interactive) {
+    n = 0;
+    while (i->buffer_len + n < i->buffer_slots && (c = getc(i->file)) != EOF) {
+      i->buffer[i->buffer_len + n++] = (char)c;
+      if (c == '\n') { break; }
+    }
+  } else {
+    n = (long)fread(i->buffer + i->buffer_len, 1, i->buffer_slots - i->buffer_len, i->file);
   }
   
+  i->buffer_len += n;
+  if (n == 0) { i->eof = 1; }
+  return n > 0;
 }
 
-static int mpc_input_failure(mpc_input_t *i, char c) {
+static int mpc_input_buffer_ensure(mpc_input_t *i) {
+  while (!mpc_input_buffer_in_range(i)) {
+    if (!mpc_input_buffer_fill(i)) { return 0; }
+  }
+  return 1;
+}
 
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
-    }
-    default: { break; }
+/*
+** Any look at a String past its end is noted
+** as the input being starved. An open run of
+** the parse engine stops there, as more input
+** might change what it sees.
+*/
+
+static int mpc_input_string_end(mpc_input_t *i) {
+  if (i->state.pos < i->length) { return 0; }
+  i->starved = 1;
+  return 1;
+}
+
+static int mpc_input_terminated(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_STRING) { return mpc_input_string_end(i); }
+  return !mpc_input_buffer_ensure(i);
+}
+
+static char mpc_input_getc(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_STRING) {
+    return mpc_input_string_end(i) ? '\0' : i->string[i->state.pos];
   }
+  return mpc_input_buffer_ensure(i) ? mpc_input_buffer_get(i) : '\0';
+}
+
+static char mpc_input_peekc(mpc_input_t *i) {
+  return mpc_input_getc(i);
+}
+
+static int mpc_input_failure(mpc_input_t *i, char c) {
+  (void) i; (void) c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-  
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -494,16 +703,10 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
-}
-
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_class(mpc_input_t *i, const mpc_class_t *c, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return mpc_class_has(c, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -512,10 +715,60 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+/*
+** Moves the cursor over `n` characters at `s`,
+** which must be those at the cursor.
+*/
+
+static void mpc_input_advance(mpc_input_t *i, const char *s, long n) {
+  
+  const char *nl;
+  
+  if (n == 0) { return; }
+  
+  i->state.pos += n;
+  i->last = s[n-1];
+  
+  while ((nl = memchr(s, '\n', n)) != NULL) {
+    n -= (long)(nl + 1 - s);
+    s = nl + 1;
+    i->state.row++;
+    i->state.col = 0;
+  }
+  i->state.col += n;
+}
+
+/*
+** A literal that lies wholly in the string or
+** in the Pipe's window is compared in place,
+** and the cursor moved over it in one step.
+** Otherwise it is matched a character at a
+** time, which fills the window as it goes.
+*/
+
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
   const char *x = c;
-
+  const char *s;
+  long n = (long)strlen(c), avail;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    s = i->string + i->state.pos;
+    avail = i->length - i->state.pos;
+  } else {
+    avail = i->buffer ? i->buffer_pos + i->buffer_len - i->state.pos : 0;
+    s = avail > 0 ? i->buffer + (i->state.pos - i->buffer_pos) : c;
+  }
+  
+  if (i->type == MPC_INPUT_STRING || avail >= n) {
+    if (n > 0 && memcmp(s, c, (size_t)(avail < n ? avail : n)) != 0) { return 0; }
+    if (avail < n) { i->starved = 1; return 0; }
+    mpc_input_advance(i, s, n);
+    *o = mpc_malloc(i, n + 1);
+    memcpy(*o, c, n + 1);
+    return 1;
+  }
+  
   mpc_input_mark(i);
   while (*x) {
     if (!mpc_input_char(i, *x, NULL)) {
@@ -531,11 +784,73 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   return 1;
 }
 
+static int mpc_soi_anchor(char prev, char next);
+static int mpc_eoi_anchor(char prev, char next);
+
+/*
+** A NUL character is only the start or end of
+** the input when it is not data. Strings know
+** their length, so they check that instead.
+*/
+
 static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
   *o = NULL;
+  if (i->type == MPC_INPUT_STRING && f == mpc_soi_anchor) { return i->state.pos == 0; }
+  if (i->type == MPC_INPUT_STRING && f == mpc_eoi_anchor) { return mpc_input_string_end(i); }
   return f(i->last, mpc_input_peekc(i));
 }
 
+/*
+** Matches a run of at least `min` characters
+** of a class, as one string, or skips over it
+** if `o` is NULL. A Pipe's window may slide
+** while the run is read, so it is copied out
+** a block at a time.
+*/
+
+static int mpc_input_span(mpc_input_t *i, const mpc_class_t *c, long min, char **o) {
+  
+  const char *s;
+  char *out;
+  long n, avail, len = 0;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    s = i->string + i->state.pos;
+    avail = i->length - i->state.pos;
+    n = mpc_class_span(c, s, avail);
+    if (n == avail) { i->starved = 1; }
+    if (n < min) { return 0; }
+    if (o) {
+      *o = mpc_malloc(i, n + 1);
+      memcpy(*o, s, n);
+      (*o)[n] = '\0';
+    }
+    mpc_input_advance(i, s, n);
+    return 1;
+  }
+  
+  out = NULL;
+  while (mpc_input_buffer_ensure(i)) {
+    s = i->buffer + (i->state.pos - i->buffer_pos);
+    avail = i->buffer_pos + i->buffer_len - i->state.pos;
+    n = mpc_class_span(c, s, avail);
+    if (n > 0 && o) {
+      out = mpc_realloc(i, out, len + n + 1);
+      memcpy(out + len, s, n);
+    }
+    len += n;
+    mpc_input_advance(i, s, n);
+    if (n < avail) { break; }
+  }
+  
+  if (len < min) { return 0; }
+  if (o == NULL) { return 1; }
+  if (out == NULL) { out = mpc_malloc(i, 1); }
+  out[len] = '\0';
+  *o = out;
+  return 1;
+}
+
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
   memcpy(r, &i->state, sizeof(mpc_state_t));
@@ -575,14 +890,12 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     case '\a': return "bell";
@@ -595,8 +908,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -606,6 +919,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int i;  
   int pos = 0; 
   int max = 1023;
+  char unescaped[4];
   char *buffer = calloc(1, 1024);
   
   if (x->failure) {
@@ -631,7 +945,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -694,6 +1008,7 @@ static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
 
 static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   int j;
+  if (x == NULL) { return NULL; }
   for (j = 0; j < x->expected_num; j++) {
     x->expected[j] = mpc_export(i, x->expected[j]);
   }
@@ -703,6 +1018,29 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? mpc_malloc(i, sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->recieved = x->recieved;
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -882,7 +1220,13 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_MEMO      = 25,
+  
+  /* Only found in compiled programs */
+  
+  MPC_TYPE_SPAN      = 26
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -892,16 +1236,81 @@ typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; mpc_class_t *c; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
-typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+/*
+** An `or` analysed by `mpc_optimise` gets a
+** dispatch table. `viable` holds a bit per
+** byte for each alternative, set if that
+** alternative can match at that byte at all,
+** and `start` the first alternative viable
+** for each byte. Redefining a parser drops the
+** tables of the `or`s that reach it.
+*/
 
-typedef union {
+typedef struct {
+  int start[256];
+  unsigned char *viable;
+} mpc_dispatch_t;
+
+/*
+** A parser run by `mpc_parse` is compiled to a
+** flat program first. A program is shared with
+** the retained parsers it reaches that have no
+** program of their own, which start at their
+** own instruction in it.
+*/
+
+typedef struct mpc_inst_t mpc_inst_t;
+typedef struct mpc_program_t mpc_program_t;
+typedef struct mpc_analysis_t mpc_analysis_t;
+
+/*
+** Counts kept for a parser while it is being
+** profiled. A run counts into a copy of its
+** own, one for each instruction, and adds them
+** to the parsers' under a lock when it ends,
+** so that runs on other threads do not race
+** it. `active` is how many runs of a parser
+** are in progress, so that the time spent in
+** a recursive parser, and the bytes it takes,
+** are only added up by the outermost run.
+*/
+
+typedef struct {
+  long calls;
+  long successes;
+  long failures;
+  long consumed;
+  long rescanned;
+  long allocs;
+  double inclusive;
+  double exclusive;
+  int active;
+} mpc_profile_t;
+
+#ifdef MPC_USE_POSIX
+static pthread_mutex_t mpc_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void mpc_profile_lock(int lock) {
+#ifdef MPC_USE_POSIX
+  if (lock) { pthread_mutex_lock(&mpc_profile_mutex); }
+  else { pthread_mutex_unlock(&mpc_profile_mutex); }
+#else
+  (void)lock;
+#endif
+}
+
+typedef struct { int n; mpc_parser_t **xs; mpc_dispatch_t *dispatch; } mpc_pdata_or_t;
+typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t copy; mpc_dtor_t dx; } mpc_pdata_memo_t;
+
+typedef union {
   mpc_pdata_fail_t fail;
   mpc_pdata_lift_t lift;
   mpc_pdata_expect_t expect;
@@ -917,6 +1326,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_memo_t memo;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -924,6 +1334,9 @@ struct mpc_parser_t {
   char *name;
   char type;
   mpc_pdata_t data;
+  mpc_program_t *program;
+  int entry;
+  mpc_profile_t *profile;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -938,14 +1351,32 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, k;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  k = strlen(xs[0]);
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  for (j = 1; j < n; j++) {
+    l = strlen(xs[j]);
+    memcpy((char*)xs[0] + k, xs[j], l + 1);
+    k += l;
+    mpc_free(i, xs[j]);
+  }
   return xs[0];
 }
 
+static mpc_val_t *mpcf_discard(int n, mpc_val_t **xs) {
+  int j;
+  for (j = 0; j < n; j++) { free(xs[j]); }
+  return NULL;
+}
+
+static mpc_val_t *mpcf_input_discard(mpc_input_t *i, int n, mpc_val_t **xs) {
+  int j;
+  for (j = 0; j < n; j++) { mpc_free(i, xs[j]); }
+  return NULL;
+}
+
 static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   mpc_state_t *s = ((mpc_state_t**)xs)[0];
   mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
@@ -965,6 +1396,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
+  if (f == mpcf_discard)   { return mpcf_input_discard(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
@@ -996,950 +1428,1877 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
+/*
+** Memo Table
+**
+** Results of `mpc_memo` parsers are kept per
+** input position, in a window of buckets that
+** starts at `memo_pos`. Each entry records the
+** outcome of one parser at one position: the
+** state it ended in and either its output or
+** its error, as well as any errors it merged
+** on the way, so that replaying it looks just
+** like running it again.
+**
+** Input behind both the lowest mark and the
+** cursor can never be parsed again, so entries
+** for it are dropped when the window next has
+** to move on.
+*/
+
+struct mpc_memo_t {
+  mpc_parser_t *parser;
+  int mode;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_dtor_t dx;
+  mpc_err_t *error;
+  mpc_err_t *merged;
+  struct mpc_memo_t *next;
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** Suppressed errors and disabled backtracking
+** both change what a parser leaves behind, so
+** results are only shared between runs made in
+** the same mode.
+*/
+
+static int mpc_memo_mode(mpc_input_t *i) {
+  return (i->suppress > 0) | ((i->backtrack > 0) << 1);
+}
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+static void mpc_memo_drop(mpc_input_t *i, long pos) {
   
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  long j, n;
+  mpc_memo_t *m, *next;
   
-  switch (p->type) {
-      
-    /* Basic Parsers */
-
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    
-    /* Other parsers */
-    
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
-    
-    /* Application Parsers */
-    
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
-    
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
-    
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
-    
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
-    
-    /* Optional Parsers */
-    
-    /* TODO: Update Not Error Message */
-    
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
-    
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
-    
-    /* Repeat Parsers */
-    
-    case MPC_TYPE_MANY:
-      
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-      
-      *e = mpc_err_merge(i, *e, results[j].error);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    case MPC_TYPE_MANY1:
-      
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-      
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
-    
-    case MPC_TYPE_COUNT:
-      
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
-      
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
-      }
-      
-    /* Combinatory Parsers */
-    
-    case MPC_TYPE_OR:
-      
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
-      }
-      
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    case MPC_TYPE_AND:
-      
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
-      }
-      mpc_input_unmark(i); 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    /* End */
-    
-    default:
-      
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
-  }
+  n = pos - i->memo_pos;
+  if (n > i->memo_slots) { n = i->memo_slots; }
+  if (n <= 0) { return; }
   
-  return 0;
+  for (j = 0; j < n; j++) {
+    for (m = i->memo[j]; m != NULL; m = next) {
+      next = m->next;
+      if (m->success && m->dx) { m->dx(m->output); }
+      mpc_err_delete_internal(i, m->error);
+      mpc_err_delete_internal(i, m->merged);
+      free(m);
+    }
+  }
   
+  memmove(i->memo, i->memo + n, sizeof(mpc_memo_t*) * (i->memo_slots - n));
+  memset(i->memo + i->memo_slots - n, 0, sizeof(mpc_memo_t*) * n);
+  i->memo_pos += n;
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p) {
+  
+  mpc_memo_t *m;
+  long j = i->state.pos - i->memo_pos;
+  int mode = mpc_memo_mode(i);
+  
+  if (j < 0 || j >= i->memo_slots) { return NULL; }
+  
+  for (m = i->memo[j]; m != NULL; m = m->next) {
+    if (m->parser == p && m->mode == mode) { return m; }
+  }
+  
+  return NULL;
+}
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e);
-  if (x) {
-    mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
+static void mpc_memo_add(mpc_input_t *i, mpc_parser_t *p, long pos, int x, mpc_result_t *r, mpc_err_t *merged) {
+  
+  long low, slots;
+  mpc_memo_t *m;
+  
+  low = i->state.pos;
+  if (i->marks_num > 0 && i->marks[0].pos < low) { low = i->marks[0].pos; }
+  if (pos < low) { return; }
+  
+  if (pos - i->memo_pos >= i->memo_slots) {
+    mpc_memo_drop(i, low);
+    if (i->memo_slots == 0) { i->memo_pos = low; }
+  }
+  
+  if (pos - i->memo_pos >= i->memo_slots) {
+    slots = i->memo_slots ? i->memo_slots * 2 : MPC_INPUT_MEMO_MIN;
+    while (pos - i->memo_pos >= slots) { slots *= 2; }
+    i->memo = realloc(i->memo, sizeof(mpc_memo_t*) * slots);
+    memset(i->memo + i->memo_slots, 0, sizeof(mpc_memo_t*) * (slots - i->memo_slots));
+    i->memo_slots = slots;
+  }
+  
+  m = malloc(sizeof(mpc_memo_t));
+  m->parser = p;
+  m->mode = mpc_memo_mode(i);
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  m->output = NULL;
+  m->dx = NULL;
+  m->error = NULL;
+  m->merged = mpc_err_export(i, mpc_err_copy(i, merged));
+  
+  if (x && p->data.memo.copy) {
+    m->output = p->data.memo.copy(r->output);
+    m->dx = p->data.memo.dx;
+  } else if (x) {
+    m->output = r->output;
   } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    m->error = mpc_err_export(i, mpc_err_copy(i, r->error));
   }
-  return x;
+  
+  m->next = i->memo[pos - i->memo_pos];
+  i->memo[pos - i->memo_pos] = m;
 }
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+/*
+** Programs
+**
+** Each parser reachable from the one compiled
+** becomes one instruction, in an array, with
+** its children as pointers to the others. The
+** data the engine reads on every step is kept
+** in the instruction, so that running it does
+** not chase back into the parser. Chains of
+** `expect` over a primitive are fused into the
+** primitive, with the message of the outermost
+** one, and repeats matched as one run into a
+** `span` instruction.
+*/
+
+struct mpc_inst_t {
+  char type;
+  char a, b;
+  char min;
+  char discard;
+  int n;
+  mpc_inst_t *x;
+  mpc_inst_t **xs;
+  const mpc_class_t *c;
+  const char *s;
+  char *m;
+  mpc_dispatch_t *dispatch;
+  mpc_parser_t *p;
+  mpc_profile_t *profile;
+};
+
+/*
+** Every program is kept in a list, with the
+** parsers it was compiled from and the parsers
+** using it, so that changing a parser compiles
+** again just the programs that reach it. Those
+** are marked `stale` while this happens.
+*/
+
+struct mpc_program_t {
+  int stale;
+  int profiled;
+  int num;
+  mpc_inst_t *code;
+  mpc_inst_t **edges;
+  mpc_analysis_t *graph;
+  int users_num;
+  mpc_parser_t **users;
+  mpc_program_t *prev;
+  mpc_program_t *next;
+};
+
+static mpc_program_t *mpc_programs = NULL;
+
+static mpc_program_t *mpc_program_new(mpc_parser_t *p);
+static void mpc_program_delete(mpc_program_t *g);
+static void mpc_program_release(mpc_parser_t *p);
+static mpc_program_t **mpc_program_stale(int n, mpc_parser_t **ps, int *num);
+static void mpc_program_refresh(mpc_program_t **gs, int num);
+static void mpc_dispatch_invalidate(mpc_program_t **gs, int num, mpc_parser_t *p);
+
+/*
+** Parse Engine
+**
+** Parsers are run by a loop over a stack of
+** frames, one for each parser in progress, so
+** deeply nested input costs heap rather than
+** C stack. A frame that runs a child records
+** the state to resume in, pushes the child and
+** goes round the loop. When a frame is done it
+** leaves its result in `x` and `ret` and pops
+** itself, and its parent carries on from the
+** state it recorded. Frames run instructions
+** of a compiled program, so a child is pushed
+** as its instruction, which acts as the call,
+** and popping a frame is the return.
+**
+** The results collected by repeats and `and`
+** are kept on one value stack shared by every
+** frame, above the `base` of the frame that
+** collects them. Errors go to the input's
+** running error, or to the nearest `memo`
+** frame below, which is the frame's `sink`.
+**
+** A profiled program also keeps, for every
+** frame, where it started and what its own
+** children have taken, to work out the counts
+** of its parser when it returns.
+**
+** A run over input that is still being fed
+** is `open`. Where a parser would look past
+** the end of what has come so far, the run
+** stops with its frames as they are, and once
+** more has come it carries on from the frame
+** on top. A `probe` run goes on from copies of
+** those frames as if the input ended there,
+** to see whether it would succeed, and builds
+** no values and reports no errors doing so.
+*/
+
+typedef struct {
+  const mpc_inst_t *c;
+  int state;
+  int sink;
+  int base;
+  int j, k;
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+  char b;
+  long pos;
+  mpc_val_t *out;
+  mpc_err_t *merged;
+} mpc_frame_t;
+
+typedef struct {
+  double start;
+  double children;
+  long pos;
+  long allocs;
+  long children_allocs;
+} mpc_frame_profile_t;
+
+typedef struct {
+  int frames_num;
+  int frames_slots;
+  mpc_frame_t *frames;
+  mpc_frame_profile_t *profile;
+  const mpc_inst_t *code;
+  mpc_profile_t *counts;
+  int values_num;
+  int values_slots;
+  mpc_result_t *values;
+  mpc_err_t *err;
+  int open;
+  int probe;
+} mpc_run_t;
+
+enum {
+  MPC_RUN_FRAMES_MIN = 64,
+  MPC_RUN_VALUES_MIN = 64
+};
+
+static double mpc_profile_now(void) {
+#ifdef MPC_USE_POSIX
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+#else
+  return clock() * (1e9 / CLOCKS_PER_SEC);
+#endif
 }
 
-int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static mpc_profile_t *mpc_profile_counts(mpc_run_t *run, const mpc_inst_t *c) {
+  return c->profile ? &run->counts[c - run->code] : NULL;
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static void mpc_profile_enter(mpc_run_t *run, mpc_input_t *i) {
+  
+  mpc_profile_t *s = mpc_profile_counts(run, run->frames[run->frames_num-1].c);
+  mpc_frame_profile_t *q = &run->profile[run->frames_num-1];
+  
+  if (s) {
+    s->calls++;
+    s->active++;
+  }
+  
+  q->pos = i->state.pos;
+  q->allocs = i->allocs;
+  q->children = 0;
+  q->children_allocs = 0;
+  q->start = mpc_profile_now();
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static void mpc_profile_return(mpc_run_t *run, mpc_input_t *i, int x) {
+  
+  int k = run->frames_num-1;
+  mpc_profile_t *s = mpc_profile_counts(run, run->frames[k].c);
+  mpc_frame_profile_t *q = &run->profile[k];
+  double t = mpc_profile_now() - q->start;
+  long allocs = i->allocs - q->allocs;
+  
+  if (s) {
+    if (x) { s->successes++; } else { s->failures++; }
+    s->allocs += allocs - q->children_allocs;
+    s->exclusive += t - q->children;
+    if (--s->active == 0) {
+      s->inclusive += t;
+      if (x) { s->consumed += i->state.pos - q->pos; }
+    }
+  }
+  
+  if (k > 0) {
+    run->profile[k-1].children += t;
+    run->profile[k-1].children_allocs += allocs;
+  }
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+static void mpc_profile_merge(mpc_run_t *run, mpc_program_t *g) {
+  
+  int k;
+  mpc_profile_t *s, *t;
+  
+  mpc_profile_lock(1);
+  for (k = 0; k < g->num; k++) {
+    s = g->code[k].profile;
+    t = &run->counts[k];
+    if (s == NULL) { continue; }
+    s->calls += t->calls;
+    s->successes += t->successes;
+    s->failures += t->failures;
+    s->consumed += t->consumed;
+    s->rescanned += t->rescanned;
+    s->allocs += t->allocs;
+    s->inclusive += t->inclusive;
+    s->exclusive += t->exclusive;
+  }
+  mpc_profile_lock(0);
+}
+
+static void mpc_run_call(mpc_run_t *run, mpc_input_t *i, const mpc_inst_t *c, int sink) {
   
-  FILE *f = fopen(filename, "rb");
-  int res;
+  mpc_frame_t *f;
   
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_file(filename, "Unable to open file!");
-    return 0;
+  if (run->frames_num == run->frames_slots) {
+    run->frames_slots *= 2;
+    run->frames = realloc(run->frames, sizeof(mpc_frame_t) * run->frames_slots);
+    if (run->profile) {
+      run->profile = realloc(run->profile, sizeof(mpc_frame_profile_t) * run->frames_slots);
+    }
   }
   
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
+  f = &run->frames[run->frames_num++];
+  f->c = c;
+  f->state = 0;
+  f->sink = sink;
+  
+  if (run->profile) { mpc_profile_enter(run, i); }
 }
 
 /*
-** Building a Parser
+** Rewinds the input, counting the bytes given
+** back against the parser that rewinds.
 */
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_run_rewind(mpc_run_t *run, mpc_input_t *i, const mpc_inst_t *c) {
+  long pos = i->state.pos;
+  mpc_input_rewind(i);
+  if (run->profile && c->profile) { mpc_profile_counts(run, c)->rescanned += pos - i->state.pos; }
+}
 
-static void mpc_undefine_or(mpc_parser_t *p) {
-  
-  int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
+static void mpc_run_push(mpc_run_t *run, mpc_result_t *r) {
+  if (run->values_num == run->values_slots) {
+    run->values_slots *= 2;
+    run->values = realloc(run->values, sizeof(mpc_result_t) * run->values_slots);
   }
-  free(p->data.or.xs);
-  
+  run->values[run->values_num++] = *r;
 }
 
-static void mpc_undefine_and(mpc_parser_t *p) {
-  
-  int i;
-  for (i = 0; i < p->data.and.n; i++) {
-    mpc_undefine_unretained(p->data.and.xs[i], 0);
+static mpc_err_t **mpc_run_err(mpc_run_t *run, int sink) {
+  return sink < 0 ? &run->err : &run->frames[sink].merged;
+}
+
+static int mpc_memo_replay(mpc_input_t *i, mpc_parser_t *p, mpc_memo_t *m, mpc_result_t *r, mpc_err_t **e) {
+  i->state = m->state;
+  i->last = m->last;
+  *e = mpc_err_merge(i, *e, mpc_err_copy(i, m->merged));
+  if (!m->success) {
+    r->error = mpc_err_copy(i, m->error);
+    return 0;
   }
-  free(p->data.and.xs);
-  free(p->data.and.dxs);
-  
+  r->output = p->data.memo.copy ? p->data.memo.copy(m->output) : m->output;
+  return 1;
 }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
-  
-  if (p->retained && !force) { return; }
-  
-  switch (p->type) {
-    
-    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
-    
-    case MPC_TYPE_ONEOF: 
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      free(p->data.string.x); 
-      break;
-    
-    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
-    
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      mpc_undefine_unretained(p->data.not.x, 0);
-      break;
-    
-    case MPC_TYPE_EXPECT:
-      mpc_undefine_unretained(p->data.expect.x, 0);
-      free(p->data.expect.m);
-      break;
-      
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      mpc_undefine_unretained(p->data.repeat.x, 0);
-      break;
-    
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
-    
-    default: break;
+/*
+** `many` and `many1` of a character class that
+** fold to a string, as `mpc_re` builds them,
+** match the whole run at once. The error for
+** the character that ends the run is made as
+** the class parser would have made it. Runs
+** whose string is only freed again are given
+** the `mpcf_discard` fold by the optimiser and
+** are not copied out at all.
+*/
+
+static mpc_parser_t *mpc_parse_span_class(mpc_parser_t *p, char **m) {
+  mpc_parser_t *x = p->data.repeat.x;
+  *m = NULL;
+  while (x->type == MPC_TYPE_EXPECT) {
+    if (*m == NULL) { *m = x->data.expect.m; }
+    x = x->data.expect.x;
+  }
+  return x;
+}
+
+static int mpc_parse_spans(mpc_parser_t *p) {
+  char *m;
+  mpc_parser_t *x;
+  if (p->data.repeat.f != mpcf_strfold
+  &&  p->data.repeat.f != mpcf_discard) { return 0; }
+  x = mpc_parse_span_class(p, &m);
+  return x->type == MPC_TYPE_ONEOF || x->type == MPC_TYPE_NONEOF;
+}
+
+static int mpc_parse_span(mpc_run_t *run, mpc_input_t *i, const mpc_inst_t *c, mpc_result_t *r, mpc_err_t **e) {
+  
+  mpc_err_t *err;
+  mpc_state_t state = i->state;
+  char last = i->last;
+  int matched;
+  
+  r->output = NULL;
+  i->starved = 0;
+  matched = mpc_input_span(i, c->c, c->min, c->discard || run->probe ? NULL : (char**)&r->output);
+  
+  /* A run up to the end of open input may go on */
+  if (i->starved && run->open) {
+    mpc_free(i, r->output);
+    i->state = state;
+    i->last = last;
+    return -1;
   }
   
-  if (!force) {
-    free(p->name);
-    free(p);
+  err = c->m ? mpc_err_new(i, c->m) : NULL;
+  if (matched) {
+    *e = mpc_err_merge(i, *e, err);
+    return 1;
   }
   
+  r->error = mpc_err_many1(i, err);
+  return 0;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-  if (p->retained) {
+/*
+** An alternative that is not viable for the
+** next byte fails there without consuming any
+** input, so it only matters for the errors it
+** reports at this position. Those are needed
+** if everything fails, or if the alternative
+** taken consumed nothing, and otherwise are
+** overtaken by errors further on.
+*/
 
-    if (p->type != MPC_TYPE_UNDEFINED) {
-      mpc_undefine_unretained(p, 0);
-    } 
-    
-    free(p->name);
-    free(p);
-  
-  } else {
-    mpc_undefine_unretained(p, 0);  
-  }
+static int mpc_dispatch_viable(mpc_dispatch_t *d, int j, char c) {
+  unsigned char b = (unsigned char)c;
+  return d->viable[j * 32 + b / 8] & (1 << (b % 8));
 }
 
-static void mpc_soft_delete(mpc_val_t *x) {
-  mpc_undefine_unretained(x, 0);
+static char mpc_dispatch_byte(mpc_input_t *i, const mpc_inst_t *c) {
+  mpc_dispatch_t *d = c->dispatch;
+  if (d == NULL) { return '\0'; }
+  return mpc_input_peekc(i);
 }
 
-static mpc_parser_t *mpc_undefined(void) {
-  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-  p->retained = 0;
-  p->type = MPC_TYPE_UNDEFINED;
-  p->name = NULL;
-  return p;
+static int mpc_dispatch_next(const mpc_inst_t *c, char b, int j) {
+  while (j < c->n && !mpc_dispatch_viable(c->dispatch, j, b)) { j++; }
+  return j;
 }
 
-mpc_parser_t *mpc_new(const char *name) {
-  mpc_parser_t *p = mpc_undefined();
-  p->retained = 1;
-  p->name = realloc(p->name, strlen(name) + 1);
-  strcpy(p->name, name);
-  return p;
+static int mpc_dispatch_skipped(const mpc_inst_t *c, char b, int k, int j) {
+  while (k < j && mpc_dispatch_viable(c->dispatch, k, b)) { k++; }
+  return k;
 }
 
-mpc_parser_t *mpc_copy(mpc_parser_t *a) {
-  int i = 0;
-  mpc_parser_t *p;
+static void mpc_run_start(mpc_run_t *run, mpc_input_t *i, mpc_program_t *g, int entry) {
   
-  if (a->retained) { return a; }
+  run->frames_num = 0;
+  run->frames_slots = MPC_RUN_FRAMES_MIN;
+  run->frames = malloc(sizeof(mpc_frame_t) * run->frames_slots);
+  run->profile = g->profiled ? malloc(sizeof(mpc_frame_profile_t) * run->frames_slots) : NULL;
+  run->code = g->code;
+  run->counts = g->profiled ? calloc((unsigned)g->num, sizeof(mpc_profile_t)) : NULL;
+  run->values_num = 0;
+  run->values_slots = MPC_RUN_VALUES_MIN;
+  run->values = malloc(sizeof(mpc_result_t) * run->values_slots);
+  run->err = mpc_err_fail(i, "Unknown Error");
+  run->err->state = mpc_state_invalid();
+  run->open = 0;
+  run->probe = 0;
   
-  p = mpc_undefined();
-  p->retained = a->retained;
-  p->type = a->type;
-  p->data = a->data;
+  mpc_run_call(run, i, &g->code[entry], -1);
+}
+
+static int mpc_run_end(mpc_run_t *run, mpc_input_t *i, mpc_program_t *g, int x, mpc_result_t *r) {
   
-  if (a->name) {
-    p->name = malloc(strlen(a->name)+1);
-    strcpy(p->name, a->name);
+  if (run->counts) { mpc_profile_merge(run, g); }
+  
+  free(run->frames);
+  free(run->profile);
+  free(run->counts);
+  free(run->values);
+  
+  if (x) {
+    mpc_err_delete_internal(i, run->err);
+    r->output = mpc_export(i, r->output);
+  } else {
+    r->error = mpc_err_export(i, mpc_err_merge(i, run->err, r->error));
   }
+  return x;
+}
+
+#define MPC_ERR mpc_run_err(run, f->sink)
+#define MPC_CALL(q, s) f->state = (s); mpc_run_call(run, i, (q), f->sink); continue
+#define MPC_RETURN() \
+  if (run->profile) { mpc_profile_return(run, i, x); } \
+  run->frames_num--; continue
+#define MPC_SUCCESS(v) ret.output = (v); x = 1; MPC_RETURN()
+#define MPC_FAILURE(v) ret.error = (v); x = 0; MPC_RETURN()
+#define MPC_STARVED() (i->starved && run->open)
+#define MPC_VALUE(v) (run->probe ? NULL : (v))
+#define MPC_PRIMITIVE(v) \
+  i->starved = 0; \
+  x = (v); \
+  if (MPC_STARVED()) { return 0; } \
+  if (x) { \
+    if (run->probe) { mpc_free(i, ret.output); } \
+    MPC_RETURN(); \
+  } \
+  MPC_FAILURE(c->m ? mpc_err_new(i, c->m) : NULL)
+
+/*
+** Runs until the stack is empty, or until an
+** open run stops, leaving frames on the stack
+** and `r` as it was.
+*/
+
+static int mpc_parse_run(mpc_run_t *run, mpc_input_t *i, mpc_result_t *r) {
   
-  switch (a->type) {
-    
-    case MPC_TYPE_FAIL:
-      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
-      strcpy(p->data.fail.m, a->data.fail.m);
-    break;
-    
-    case MPC_TYPE_ONEOF: 
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      p->data.string.x = malloc(strlen(a->data.string.x)+1);
-      strcpy(p->data.string.x, a->data.string.x);
-      break;
-    
-    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
-    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
-    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+  int x = 0, k;
+  const mpc_inst_t *c;
+  mpc_parser_t *p;
+  mpc_frame_t *f;
+  mpc_memo_t *m;
+  mpc_result_t ret;
+  
+  ret.output = NULL;
+  
+  while (run->frames_num > 0) {
     
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      p->data.not.x = mpc_copy(a->data.not.x);
-      break;
+    f = &run->frames[run->frames_num-1];
+    c = f->c;
+    p = c->p;
     
-    case MPC_TYPE_EXPECT:
-      p->data.expect.x = mpc_copy(a->data.expect.x);
-      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
-      strcpy(p->data.expect.m, a->data.expect.m);
-      break;
+    switch (c->type) {
       
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      p->data.repeat.x = mpc_copy(a->data.repeat.x);
-      break;
-    
-    case MPC_TYPE_OR:
-      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.or.n; i++) {
-        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
-      }
-    break;
-    case MPC_TYPE_AND:
-      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.and.n; i++) {
-        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
-      }
-      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
-      for (i = 0; i < a->data.and.n-1; i++) {
-        p->data.and.dxs[i] = a->data.and.dxs[i];
-      }
-    break;
+      /* Basic Parsers */
+      
+      case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&ret.output));
+      case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, c->a, (char**)&ret.output));
+      case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, c->a, c->b, (char**)&ret.output));
+      case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_class(i, c->c, (char**)&ret.output));
+      case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_class(i, c->c, (char**)&ret.output));
+      case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&ret.output));
+      case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, c->s, (char**)&ret.output));
+      case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&ret.output));
+      
+      /* Other parsers */
+      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(MPC_VALUE(p->data.lift.lf()));
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+      case MPC_TYPE_STATE:     MPC_SUCCESS(MPC_VALUE(mpc_input_state_copy(i)));
+      
+      /* Application Parsers */
+      
+      case MPC_TYPE_APPLY:
+        if (f->state == 0) { MPC_CALL(c->x, 1); }
+        if (x) { MPC_SUCCESS(MPC_VALUE(mpc_parse_apply(i, p->data.apply.f, ret.output))); }
+        MPC_FAILURE(ret.error);
+      
+      case MPC_TYPE_APPLY_TO:
+        if (f->state == 0) { MPC_CALL(c->x, 1); }
+        if (x) { MPC_SUCCESS(MPC_VALUE(mpc_parse_apply_to(i, p->data.apply_to.f, ret.output, p->data.apply_to.d))); }
+        MPC_FAILURE(ret.error);
+      
+      case MPC_TYPE_EXPECT:
+        if (f->state == 0) {
+          mpc_input_suppress_enable(i);
+          MPC_CALL(c->x, 1);
+        }
+        mpc_input_suppress_disable(i);
+        if (x) { MPC_SUCCESS(ret.output); }
+        MPC_FAILURE(mpc_err_new(i, c->m));
+      
+      case MPC_TYPE_PREDICT:
+        if (f->state == 0) {
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(c->x, 1);
+        }
+        mpc_input_backtrack_enable(i);
+        MPC_RETURN();
+      
+      case MPC_TYPE_MEMO:
+        if (f->state == 0) {
+          m = mpc_memo_find(i, p);
+          if (m != NULL && run->probe) {
+            i->state = m->state;
+            i->last = m->last;
+            ret.output = NULL;
+            x = m->success;
+            MPC_RETURN();
+          }
+          if (m != NULL) {
+            x = mpc_memo_replay(i, p, m, &ret, MPC_ERR);
+            MPC_RETURN();
+          }
+          f->pos = i->state.pos;
+          f->merged = NULL;
+          f->state = 1;
+          mpc_run_call(run, i, c->x, run->frames_num-1);
+          continue;
+        }
+        if (run->probe) { MPC_RETURN(); }
+        if (x) { ret.output = mpc_export(i, ret.output); }
+        mpc_memo_add(i, p, f->pos, x, &ret, f->merged);
+        *MPC_ERR = mpc_err_merge(i, *MPC_ERR, f->merged);
+        MPC_RETURN();
+      
+      /* Optional Parsers */
+      
+      /* TODO: Update Not Error Message */
+      
+      case MPC_TYPE_NOT:
+        if (f->state == 0) {
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(c->x, 1);
+        }
+        if (x) {
+          mpc_run_rewind(run, i, c);
+          mpc_input_suppress_disable(i);
+          if (!run->probe) { mpc_parse_dtor(i, p->data.not.dx, ret.output); }
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
+        }
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(MPC_VALUE(p->data.not.lf()));
+      
+      case MPC_TYPE_MAYBE:
+        if (f->state == 0) { MPC_CALL(c->x, 1); }
+        if (x) { MPC_RETURN(); }
+        *MPC_ERR = mpc_err_merge(i, *MPC_ERR, ret.error);
+        MPC_SUCCESS(MPC_VALUE(p->data.not.lf()));
+      
+      /* Repeat Parsers */
+      
+      case MPC_TYPE_SPAN:
+        x = mpc_parse_span(run, i, c, &ret, MPC_ERR);
+        if (x < 0) { return 0; }
+        MPC_RETURN();
+      
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        if (f->state == 0) {
+          f->base = run->values_num;
+          f->j = 0;
+          MPC_CALL(c->x, 1);
+        }
+        if (x) {
+          mpc_run_push(run, &ret);
+          f->j++;
+          MPC_CALL(c->x, 1);
+        }
+        if (c->type == MPC_TYPE_MANY1 && f->j == 0) {
+          MPC_FAILURE(mpc_err_many1(i, ret.error));
+        }
+        *MPC_ERR = mpc_err_merge(i, *MPC_ERR, ret.error);
+        ret.output = MPC_VALUE(mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)(run->values + f->base)));
+        run->values_num = f->base;
+        x = 1;
+        MPC_RETURN();
+      
+      case MPC_TYPE_COUNT:
+        if (f->state == 0) {
+          f->base = run->values_num;
+          f->j = 0;
+          MPC_CALL(c->x, 1);
+        }
+        if (!x) {
+          for (k = 0; k < f->j && !run->probe; k++) {
+            mpc_parse_dtor(i, p->data.repeat.dx, run->values[f->base + k].output);
+          }
+          run->values_num = f->base;
+          MPC_FAILURE(mpc_err_count(i, ret.error, c->n));
+        }
+        mpc_run_push(run, &ret);
+        if (++f->j < c->n) { MPC_CALL(c->x, 1); }
+        ret.output = MPC_VALUE(mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)(run->values + f->base)));
+        run->values_num = f->base;
+        x = 1;
+        MPC_RETURN();
+      
+      /* Combinatory Parsers */
+      
+      /*
+      ** An `or` with a dispatch table runs only the
+      ** alternatives viable for the next byte (in
+      ** state 2) and then, if their errors are
+      ** wanted, the ones it skipped (in state 3).
+      */
+      
+      case MPC_TYPE_OR:
+        
+        if (f->state == 0) {
+          if (c->n == 0) { MPC_SUCCESS(NULL); }
+          i->starved = 0;
+          f->b = mpc_dispatch_byte(i, c);
+          if (MPC_STARVED()) { return 0; }
+          if (f->b == '\0') {
+            f->j = 0;
+            MPC_CALL(c->xs[0], 1);
+          }
+          f->pos = i->state.pos;
+          f->x = 0;
+          f->k = -1;
+          f->j = mpc_dispatch_next(c, f->b, c->dispatch->start[(unsigned char)f->b]);
+          if (f->j < c->n) { MPC_CALL(c->xs[f->j], 2); }
+        }
+        
+        if (f->state == 1) {
+          if (x) { MPC_RETURN(); }
+          *MPC_ERR = mpc_err_merge(i, *MPC_ERR, ret.error);
+          if (++f->j < c->n) { MPC_CALL(c->xs[f->j], 1); }
+          MPC_FAILURE(NULL);
+        }
+        
+        if (f->state == 2) {
+          if (x) {
+            f->x = 1;
+            f->out = ret.output;
+          } else {
+            *MPC_ERR = mpc_err_merge(i, *MPC_ERR, ret.error);
+            f->j = mpc_dispatch_next(c, f->b, f->j + 1);
+            if (f->j < c->n) { MPC_CALL(c->xs[f->j], 2); }
+          }
+        }
+        
+        if (f->state == 3) { *MPC_ERR = mpc_err_merge(i, *MPC_ERR, ret.error); }
+        
+        if (!i->suppress && (!f->x || i->state.pos == f->pos)) {
+          f->k = mpc_dispatch_skipped(c, f->b, f->k + 1, f->j);
+          if (f->k < f->j) { MPC_CALL(c->xs[f->k], 3); }
+        }
+        
+        if (f->x) { MPC_SUCCESS(f->out); }
+        MPC_FAILURE(NULL);
+      
+      case MPC_TYPE_AND:
+        
+        if (f->state == 0) {
+          if (c->n == 0) { MPC_SUCCESS(NULL); }
+          f->base = run->values_num;
+          f->j = 0;
+          mpc_input_mark(i);
+          MPC_CALL(c->xs[0], 1);
+        }
+        
+        if (!x) {
+          mpc_run_rewind(run, i, c);
+          for (k = 0; k < f->j && !run->probe; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], run->values[f->base + k].output);
+          }
+          run->values_num = f->base;
+          MPC_RETURN();
+        }
+        
+        mpc_run_push(run, &ret);
+        if (++f->j < c->n) { MPC_CALL(c->xs[f->j], 1); }
+        mpc_input_unmark(i);
+        ret.output = MPC_VALUE(mpc_parse_fold(i, p->data.and.f, f->j, (mpc_val_t**)(run->values + f->base)));
+        run->values_num = f->base;
+        x = 1;
+        MPC_RETURN();
+      
+      /* End */
+      
+      default:
+        
+        MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    }
     
-    default: break;
   }
-
-  
-  return p;
-}
-
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-  mpc_undefine_unretained(p, 1);
-  p->type = MPC_TYPE_UNDEFINED;
-  return p;
-}
-
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
-  }
+  *r = ret;
+  return x;
   
-  free(a);
-  return p;  
 }
 
-void mpc_cleanup(int n, ...) {
-  int i;
-  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
-  
-  va_list va;
-  va_start(va, n);
-  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
-  va_end(va);  
+#undef MPC_ERR
+#undef MPC_CALL
+#undef MPC_RETURN
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_STARVED
+#undef MPC_VALUE
+#undef MPC_PRIMITIVE
 
-  free(list);
+static int mpc_parse_program(mpc_input_t *i, mpc_program_t *g, int entry, mpc_result_t *r) {
+  int x;
+  mpc_run_t run;
+  mpc_run_start(&run, i, g, entry);
+  x = mpc_parse_run(&run, i, r);
+  return mpc_run_end(&run, i, g, x, r);
 }
 
-mpc_parser_t *mpc_pass(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PASS;
-  return p;
+/*
+** Parsing only reads the parser. One without a
+** program, built but never defined, compiled or
+** optimised, is compiled for this parse alone.
+*/
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_program_t *g;
+  if (p->program) { return mpc_parse_program(i, p->program, p->entry, r); }
+  g = mpc_program_new(p);
+  x = mpc_parse_program(i, g, 0, r);
+  mpc_program_delete(g);
+  return x;
 }
 
-mpc_parser_t *mpc_fail(const char *m) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  p->data.fail.m = malloc(strlen(m) + 1);
-  strcpy(p->data.fail.m, m);
-  return p;
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-/*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to 
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
-*/
-
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
-  
-  va_list va;
-  char *buffer;
-
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
-  
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.fail.m = buffer;
-  return p;
-
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT_VAL;
-  p->data.lift.x = x;
-  return p;
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT;
-  p->data.lift.lf = lf;
-  return p;
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANCHOR;
-  p->data.anchor.f = f;
-  return mpc_expect(p, "anchor");
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  
+  FILE *f = fopen(filename, "rb");
+  int res;
+  
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+  
+  res = mpc_parse_file(filename, f, p, r);
+  fclose(f);
+  return res;
 }
 
-mpc_parser_t *mpc_state(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STATE;
-  return p;
+/*
+** Batch Parsing
+**
+** Workers take the next unparsed string under
+** a lock until none are left. Each parse has
+** its own input, so the only state they share
+** is the program, which they only read.
+*/
+
+typedef struct {
+  const char *filename;
+  const char **strings;
+  int n;
+  int next;
+  mpc_program_t *g;
+  int entry;
+  mpc_result_t *r;
+  int *x;
+#ifdef MPC_USE_POSIX
+  pthread_mutex_t lock;
+#endif
+} mpc_batch_t;
+
+static int mpc_batch_take(mpc_batch_t *b) {
+  int j;
+#ifdef MPC_USE_POSIX
+  pthread_mutex_lock(&b->lock);
+#endif
+  j = b->next < b->n ? b->next++ : b->n;
+#ifdef MPC_USE_POSIX
+  pthread_mutex_unlock(&b->lock);
+#endif
+  return j;
+}
+
+static void *mpc_batch_work(void *data) {
+  mpc_batch_t *b = data;
+  int j;
+  mpc_input_t *i;
+  while ((j = mpc_batch_take(b)) < b->n) {
+    i = mpc_input_new_string(b->filename, b->strings[j]);
+    b->x[j] = mpc_parse_program(i, b->g, b->entry, &b->r[j]);
+    mpc_input_delete(i);
+  }
+  return NULL;
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
-  return p;
+int mpc_parse_batch(const char *filename, const char **strings, int n, mpc_parser_t *p, mpc_result_t *r, int *x, int nthreads) {
+  
+  mpc_batch_t b;
+  int j, parsed = 0;
+#ifdef MPC_USE_POSIX
+  pthread_t *threads = NULL;
+  int started = 0;
+#endif
+  
+  b.filename = filename;
+  b.strings = strings;
+  b.n = n;
+  b.next = 0;
+  b.g = p->program ? p->program : mpc_program_new(p);
+  b.entry = p->program ? p->entry : 0;
+  b.r = r;
+  b.x = x;
+  
+  if (nthreads > n) { nthreads = n; }
+  
+#ifdef MPC_USE_POSIX
+  pthread_mutex_init(&b.lock, NULL);
+  if (nthreads > 1) {
+    threads = malloc(sizeof(pthread_t) * (nthreads-1));
+    for (started = 0; started < nthreads-1; started++) {
+      if (pthread_create(&threads[started], NULL, mpc_batch_work, &b) != 0) { break; }
+    }
+  }
+#endif
+  
+  /* The calling thread works too, and alone if no threads started */
+  mpc_batch_work(&b);
+  
+#ifdef MPC_USE_POSIX
+  for (j = 0; j < started; j++) { pthread_join(threads[j], NULL); }
+  free(threads);
+  pthread_mutex_destroy(&b.lock);
+#endif
+  
+  if (b.g != p->program) { mpc_program_delete(b.g); }
+  
+  for (j = 0; j < n; j++) { parsed += x[j] ? 1 : 0; }
+  return parsed;
 }
 
 /*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
+** Incremental Parsing
 **
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to 
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
+** Chunks fed in are appended to a buffer, over
+** which one parse at a time is run as an open
+** run. Each feed points the input at the grown
+** buffer and carries the run on from where it
+** stopped. A run that stops again is probed to
+** tell READY from MORE, and `mpc_parse_finish`
+** ends the input and lets it run to the end.
 **
+** After a final result the buffer is emptied,
+** except for input following a successful
+** parse, which is kept for the next one.
 */
 
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-  va_list va;
+struct mpc_parse_ctx_t {
+  char *filename;
+  mpc_parser_t *parser;
+  mpc_dtor_t dtor;
   char *buffer;
+  size_t length;
+  size_t slots;
+  mpc_input_t *input;
+  mpc_program_t *program;
+  mpc_run_t run;
+};
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
-  
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.expect.x = a;
-  p->data.expect.m = buffer;
-  return p;
+mpc_parse_ctx_t *mpc_parse_ctx_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d) {
+  mpc_parse_ctx_t *c = malloc(sizeof(mpc_parse_ctx_t));
+  c->filename = malloc(strlen(filename) + 1);
+  strcpy(c->filename, filename);
+  c->parser = p;
+  c->dtor = d;
+  c->buffer = NULL;
+  c->length = 0;
+  c->slots = 0;
+  c->input = NULL;
+  c->program = NULL;
+  return c;
+}
+
+static void mpc_parse_ctx_start(mpc_parse_ctx_t *c) {
+  mpc_parser_t *p = c->parser;
+  c->program = p->program ? p->program : mpc_program_new(p);
+  c->input = mpc_input_new_nstring(c->filename, c->buffer ? c->buffer : "", c->length);
+  mpc_run_start(&c->run, c->input, c->program, p->program ? p->entry : 0);
+  c->run.open = 1;
 }
 
 /*
-** Basic Parsers
+** Errors made at the end of the buffer said
+** they got the end of input, which may since
+** have been followed by more.
 */
 
-mpc_parser_t *mpc_any(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANY;
-  return mpc_expect(p, "any character");
-}
+static int mpc_parse_ctx_end(mpc_parse_ctx_t *c, int x, mpc_result_t *r) {
+  
+  long n = x ? c->input->state.pos : (long)c->length;
+  mpc_err_t *e;
+  
+  x = mpc_run_end(&c->run, c->input, c->program, x, r);
+  mpc_input_delete(c->input);
+  c->input = NULL;
+  if (c->program != c->parser->program) { mpc_program_delete(c->program); }
+  c->program = NULL;
+  
+  if (!x) {
+    e = r->error;
+    if (e->failure == NULL && e->state.pos >= 0 && e->state.pos < (long)c->length) {
+      e->recieved = c->buffer[e->state.pos];
+    }
+  }
 
-mpc_parser_t *mpc_char(char c) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SINGLE;
-  p->data.single.x = c;
-  return mpc_expectf(p, "'%c'", c);
+  if (n > 0) { memmove(c->buffer, c->buffer + n, c->length - n); }
+  c->length -= n;
+  return x ? MPC_PARSE_DONE : MPC_PARSE_ERROR;
 }
 
-mpc_parser_t *mpc_range(char s, char e) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_RANGE;
-  p->data.range.x = s;
-  p->data.range.y = e;
-  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+/*
+** The probe runs on a copy of the frames, and
+** the input is put back as it was afterwards,
+** marks included. It never reads the values
+** stacked, so it stacks its own over nothing.
+*/
+
+static int mpc_parse_ctx_probe(mpc_parse_ctx_t *c) {
+  
+  int x, k;
+  mpc_run_t q = c->run;
+  mpc_input_t *i = c->input;
+  mpc_state_t state = i->state;
+  char last = i->last;
+  long allocs = i->allocs;
+  int suppress = i->suppress;
+  int backtrack = i->backtrack;
+  int marks_num = i->marks_num;
+  int marks_slots = i->marks_slots;
+  mpc_state_t *marks = i->marks;
+  char *lasts = i->lasts;
+  mpc_result_t r;
+  
+  q.frames = malloc(sizeof(mpc_frame_t) * q.frames_slots);
+  memcpy(q.frames, c->run.frames, sizeof(mpc_frame_t) * q.frames_num);
+  for (k = 0; k < q.frames_num; k++) { q.frames[k].merged = NULL; }
+  q.values = malloc(sizeof(mpc_result_t) * q.values_slots);
+  q.profile = NULL;
+  q.counts = NULL;
+  q.err = NULL;
+  q.open = 0;
+  q.probe = 1;
+  
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  memcpy(i->marks, marks, sizeof(mpc_state_t) * marks_num);
+  memcpy(i->lasts, lasts, sizeof(char) * marks_num);
+  mpc_input_suppress_enable(i);
+  
+  x = mpc_parse_run(&q, i, &r);
+  
+  free(i->marks);
+  free(i->lasts);
+  i->state = state;
+  i->last = last;
+  i->allocs = allocs;
+  i->suppress = suppress;
+  i->backtrack = backtrack;
+  i->marks_num = marks_num;
+  i->marks_slots = marks_slots;
+  i->marks = marks;
+  i->lasts = lasts;
+  
+  free(q.frames);
+  free(q.values);
+  return x;
 }
 
-mpc_parser_t *mpc_oneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+static int mpc_parse_ctx_run(mpc_parse_ctx_t *c, mpc_result_t *r) {
+  
+  int x = mpc_parse_run(&c->run, c->input, r);
+  
+  if (c->run.frames_num == 0) { return mpc_parse_ctx_end(c, x, r); }
+
+  r->output = NULL;
+  return mpc_parse_ctx_probe(c) ? MPC_PARSE_READY : MPC_PARSE_MORE;
 }
 
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "none of '%s'", s);
+int mpc_parse_feed(mpc_parse_ctx_t *c, const char *chunk, size_t length, mpc_result_t *r) {
+  
+  if (c->length + length > c->slots) {
+    c->slots = c->slots * 2 > c->length + length ? c->slots * 2 : c->length + length;
+    c->buffer = realloc(c->buffer, c->slots);
+  }
+  if (length > 0) { memcpy(c->buffer + c->length, chunk, length); }
+  c->length += length;
+  
+  if (c->input == NULL) {
+    mpc_parse_ctx_start(c);
+  } else {
+    c->input->string = c->buffer ? c->buffer : "";
+    c->input->length = (long)c->length;
+  }
 
+  return mpc_parse_ctx_run(c, r);
 }
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SATISFY;
-  p->data.satisfy.f = f;
-  return mpc_expectf(p, "character satisfying function %p", f);
+int mpc_parse_finish(mpc_parse_ctx_t *c, mpc_result_t *r) {
+  
+  int x;
+  
+  if (c->input == NULL) { mpc_parse_ctx_start(c); }
+  c->run.open = 0;
+  
+  x = mpc_parse_ctx_run(c, r);
+  c->length = 0;
+  return x;
 }
 
-mpc_parser_t *mpc_string(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "\"%s\"", s);
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c) {
+  
+  mpc_result_t r;
+  
+  if (c->input != NULL) {
+    if (mpc_parse_finish(c, &r) == MPC_PARSE_DONE) {
+      c->dtor(r.output);
+    } else {
+      mpc_err_delete(r.error);
+    }
+  }
+
+  free(c->filename);
+  free(c->buffer);
+  free(c);
 }
 
 /*
-** Core Parsers
+** Building a Parser
 */
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY;
-  p->data.apply.x = a;
-  p->data.apply.f = f;
-  return p;
-}
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY_TO;
-  p->data.apply_to.x = a;
-  p->data.apply_to.f = f;
-  p->data.apply_to.d = x;
-  return p;
+static void mpc_dispatch_delete(mpc_dispatch_t *d) {
+  if (d == NULL) { return; }
+  free(d->viable);
+  free(d);
 }
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PREDICT;
-  p->data.predict.x = a;
-  return p;
+static void mpc_undefine_or(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  }
+  free(p->data.or.xs);
+  mpc_dispatch_delete(p->data.or.dispatch);
+  
 }
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NOT;
-  p->data.not.x = a;
-  p->data.not.dx = da;
-  p->data.not.lf = lf;
-  return p;
+static void mpc_undefine_and(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.and.n; i++) {
+    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  }
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+  
 }
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-  return mpc_not_lift(a, da, mpcf_ctor_null);
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+  
+  if (p->retained && !force) { return; }
+  
+  mpc_program_release(p);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+    
+    case MPC_TYPE_ONEOF: 
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      free(p->data.string.x); 
+      free(p->data.string.c);
+      break;
+    
+    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_undefine_unretained(p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_undefine_unretained(p->data.expect.x, 0);
+      free(p->data.expect.m);
+      break;
+      
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_undefine_unretained(p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    
+    default: break;
+  }
+  
+  if (!force) {
+    free(p->profile);
+    free(p->name);
+    free(p);
+  }
+  
 }
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MAYBE;
-  p->data.not.x = a;
-  p->data.not.lf = lf;
-  return p;
+void mpc_delete(mpc_parser_t *p) {
+  if (p->retained) {
+
+    if (p->type != MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(p, 0);
+    } 
+    
+    mpc_program_release(p);
+    free(p->profile);
+    free(p->name);
+    free(p);
+  
+  } else {
+    mpc_undefine_unretained(p, 0);  
+  }
 }
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-  return mpc_maybe_lift(a, mpcf_ctor_null);
+static void mpc_soft_delete(mpc_val_t *x) {
+  mpc_undefine_unretained(x, 0);
 }
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
+static mpc_parser_t *mpc_undefined(void) {
+  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+  p->retained = 0;
+  p->type = MPC_TYPE_UNDEFINED;
+  p->name = NULL;
   return p;
 }
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+mpc_parser_t *mpc_new(const char *name) {
   mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY1;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
+  p->retained = 1;
+  p->name = realloc(p->name, strlen(name) + 1);
+  strcpy(p->name, name);
   return p;
 }
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_COUNT;
-  p->data.repeat.n = n;
-  p->data.repeat.f = f;
-  p->data.repeat.x = a;
-  p->data.repeat.dx = da;
+mpc_parser_t *mpc_copy(mpc_parser_t *a) {
+  int i = 0;
+  mpc_parser_t *p;
+  
+  if (a->retained) { return a; }
+  
+  p = mpc_undefined();
+  p->retained = a->retained;
+  p->type = a->type;
+  p->data = a->data;
+  
+  if (a->name) {
+    p->name = malloc(strlen(a->name)+1);
+    strcpy(p->name, a->name);
+  }
+  
+  switch (a->type) {
+    
+    case MPC_TYPE_FAIL:
+      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
+      strcpy(p->data.fail.m, a->data.fail.m);
+    break;
+    
+    case MPC_TYPE_ONEOF: 
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = malloc(strlen(a->data.string.x)+1);
+      strcpy(p->data.string.x, a->data.string.x);
+      if (a->data.string.c) { p->data.string.c = mpc_class_copy(a->data.string.c); }
+      break;
+    
+    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      p->data.not.x = mpc_copy(a->data.not.x);
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_copy(a->data.expect.x);
+      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
+      strcpy(p->data.expect.m, a->data.expect.m);
+      break;
+      
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.x = mpc_copy(a->data.repeat.x);
+      break;
+    
+    case MPC_TYPE_OR:
+      p->data.or.dispatch = NULL;
+      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.or.n; i++) {
+        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
+      }
+    break;
+    case MPC_TYPE_AND:
+      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.and.n; i++) {
+        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
+      }
+      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
+      for (i = 0; i < a->data.and.n-1; i++) {
+        p->data.and.dxs[i] = a->data.and.dxs[i];
+      }
+    break;
+    
+    default: break;
+  }
+
+  
   return p;
 }
 
-mpc_parser_t *mpc_or(int n, ...) {
-
-  int i;
-  va_list va;
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  int n;
+  mpc_program_t **gs = mpc_program_stale(1, &p, &n);
+  mpc_dispatch_invalidate(gs, n, p);
+  mpc_undefine_unretained(p, 1);
+  p->type = MPC_TYPE_UNDEFINED;
+  mpc_program_refresh(gs, n);
+  return p;
+}
 
-  mpc_parser_t *p = mpc_undefined();
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  int n;
+  mpc_program_t **gs = mpc_program_stale(1, &p, &n);
+  mpc_dispatch_invalidate(gs, n, p);
   
-  va_start(va, n);  
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  if (p->retained) {
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
   }
-  va_end(va);
   
-  return p;
+  mpc_program_release(a);
+  free(a->profile);
+  free(a);
+  mpc_program_refresh(gs, n);
+  
+  if (p->program == NULL) { mpc_compile(p); }
+  return p;  
 }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
-
+void mpc_cleanup(int n, ...) {
   int i;
+  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+  
   va_list va;
+  va_start(va, n);
+  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
+  va_end(va);  
 
-  mpc_parser_t *p = mpc_undefined();
-  
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = f;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  free(list);
+}
 
-  va_start(va, f);  
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
-  }  
-  va_end(va);
-  
+mpc_parser_t *mpc_pass(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PASS;
   return p;
 }
 
-/*
-** Common Parsers
-*/
+mpc_parser_t *mpc_fail(const char *m) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  p->data.fail.m = malloc(strlen(m) + 1);
+  strcpy(p->data.fail.m, m);
+  return p;
+}
 
-static int mpc_soi_anchor(char prev, char next) { (void) next; return (prev == '\0'); }
-static int mpc_eoi_anchor(char prev, char next) { (void) prev; return (next == '\0'); }
+/*
+** As `snprintf` is not ANSI standard this 
+** function `mpc_failf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to 
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
 
-mpc_parser_t *mpc_soi(void) { return mpc_expect(mpc_anchor(mpc_soi_anchor), "start of input"); }
-mpc_parser_t *mpc_eoi(void) { return mpc_expect(mpc_anchor(mpc_eoi_anchor), "end of input"); }
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+  
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+  
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.fail.m = buffer;
+  return p;
 
-static int mpc_boundary_anchor(char prev, char next) {
-  const char* word = "abcdefghijklmnopqrstuvwxyz"
-                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                     "0123456789_";
-  if ( strchr(word, next) &&  prev == '\0') { return 1; }
-  if ( strchr(word, prev) &&  next == '\0') { return 1; }
-  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
-  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
-  return 0;
 }
 
-mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT_VAL;
+  p->data.lift.x = x;
+  return p;
+}
 
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT;
+  p->data.lift.lf = lf;
+  return p;
+}
 
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANCHOR;
+  p->data.anchor.f = f;
+  return mpc_expect(p, "anchor");
+}
 
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+mpc_parser_t *mpc_state(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STATE;
+  return p;
+}
 
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  p->data.expect.x = a;
+  p->data.expect.m = malloc(strlen(expected) + 1);
+  strcpy(p->data.expect.m, expected);
+  return p;
+}
 
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+/*
+** As `snprintf` is not ANSI standard this 
+** function `mpc_expectf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to 
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
 
-mpc_parser_t *mpc_real(void) {
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
 
-  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
-  
-  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
   
-  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-  p30 = mpc_oneof("eE");
-  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
   
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.expect.x = a;
+  p->data.expect.m = buffer;
+  return p;
+}
+
+/*
+** Basic Parsers
+*/
 
+mpc_parser_t *mpc_any(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANY;
+  return mpc_expect(p, "any character");
 }
 
-mpc_parser_t *mpc_float(void) {
-  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+mpc_parser_t *mpc_char(char c) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SINGLE;
+  p->data.single.x = c;
+  return mpc_expectf(p, "'%c'", c);
 }
 
-mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+mpc_parser_t *mpc_range(char s, char e) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_RANGE;
+  p->data.range.x = s;
+  p->data.range.y = e;
+  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
 }
 
-mpc_parser_t *mpc_string_lit(void) {
-  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+mpc_parser_t *mpc_oneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  p->data.string.c = mpc_class_new(s, 0);
+  return mpc_expectf(p, "one of '%s'", s);
 }
 
-mpc_parser_t *mpc_regex_lit(void) {  
-  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+mpc_parser_t *mpc_noneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  p->data.string.c = mpc_class_new(s, 1);
+  return mpc_expectf(p, "none of '%s'", s);
+
 }
 
-mpc_parser_t *mpc_ident(void) {
-  mpc_parser_t *p0, *p1; 
-  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SATISFY;
+  p->data.satisfy.f = f;
+  return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STRING;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "\"%s\"", s);
 }
 
 /*
-** Useful Parsers
+** Core Parsers
 */
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
-
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY;
+  p->data.apply.x = a;
+  p->data.apply.f = f;
+  return p;
+}
 
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY_TO;
+  p->data.apply_to.x = a;
+  p->data.apply_to.f = f;
+  p->data.apply_to.d = x;
+  return p;
+}
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_string(o), a, mpc_string(c),
-    free, ad);
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = a;
+  return p;
 }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.copy = copy;
+  p->data.memo.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NOT;
+  p->data.not.x = a;
+  p->data.not.dx = da;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+  return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MAYBE;
+  p->data.not.x = a;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+  return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY1;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_COUNT;
+  p->data.repeat.n = n;
+  p->data.repeat.f = f;
+  p->data.repeat.x = a;
+  p->data.repeat.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  
+  va_start(va, n);  
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+  
+  return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, f);  
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  }  
+  va_end(va);
+  
+  return p;
+}
+
+/*
+** Common Parsers
+*/
+
+static int mpc_soi_anchor(char prev, char next) { (void) next; return (prev == '\0'); }
+static int mpc_eoi_anchor(char prev, char next) { (void) prev; return (next == '\0'); }
+
+mpc_parser_t *mpc_soi(void) { return mpc_expect(mpc_anchor(mpc_soi_anchor), "start of input"); }
+mpc_parser_t *mpc_eoi(void) { return mpc_expect(mpc_anchor(mpc_eoi_anchor), "end of input"); }
+
+static int mpc_boundary_anchor(char prev, char next) {
+  const char* word = "abcdefghijklmnopqrstuvwxyz"
+                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                     "0123456789_";
+  if ( strchr(word, next) &&  prev == '\0') { return 1; }
+  if ( strchr(word, prev) &&  next == '\0') { return 1; }
+  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
+  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+  return 0;
+}
+
+mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+  
+  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  
+  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p1 = mpc_digits();
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p30 = mpc_oneof("eE");
+  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p32 = mpc_digits();
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {  
+  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+  mpc_parser_t *p0, *p1; 
+  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
+  return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_string(o), a, mpc_string(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
 
 mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
   return mpc_and(3, mpcf_snd_free,
@@ -2442,16 +3801,20 @@ mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2)
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, k;
   
   if (n == 0) { return calloc(1, 1); }
   
   for (i = 0; i < n; i++) { l += strlen(xs[i]); }
   
+  k = strlen(xs[0]);
   xs[0] = realloc(xs[0], l + 1);
   
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    l = strlen(xs[i]);
+    memcpy((char*)xs[0] + k, xs[i], l + 1);
+    k += l;
+    free(xs[i]);
   }
   
   return xs[0];
@@ -2560,6 +3923,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2682,6 +4046,24 @@ void mpc_ast_delete(mpc_ast_t *a) {
   
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_add_child(b, mpc_ast_copy(a->children[i]));
+  }
+  
+  return b;
+  
+}
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
@@ -2753,10 +4135,20 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   return 1;
 }
 
+/*
+** Children arrays grow geometrically. Their
+** capacity is not stored - it is always the
+** smallest power of two that holds every child,
+** so the array only has to be reallocated when
+** `children_num` reaches a power of two.
+*/
+
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
+  int n = r->children_num;
+  if ((n & (n - 1)) == 0) {
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * (n ? n * 2 : 1));
+  }
+  r->children[r->children_num++] = a;
   return r;
 }
 
@@ -3060,6 +4452,7 @@ mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
 
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
 mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
@@ -3112,719 +4505,1581 @@ mpc_parser_t *mpca_and(int n, ...) {
   return p;  
 }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
-
-/*
-** Grammar Parser
-*/
-
-/*
-** This is another interesting bootstrapping.
-**
-** Having a general purpose AST type allows
-** users to specify the grammar alone and
-** let all fold rules be automatically taken
-** care of by existing functions.
-**
-** You don't get to control the type spat
-** out but this means you can make a nice
-** parser to take in some grammar in nice
-** syntax and spit out a parser that works.
-**
-** The grammar for this looks surprisingly
-** like regex but the main difference is that
-** it is now whitespace insensitive and the
-** base type takes literals of some form.
-*/
-
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+
+/*
+** Grammar Parser
+*/
+
+/*
+** This is another interesting bootstrapping.
+**
+** Having a general purpose AST type allows
+** users to specify the grammar alone and
+** let all fold rules be automatically taken
+** care of by existing functions.
+**
+** You don't get to control the type spat
+** out but this means you can make a nice
+** parser to take in some grammar in nice
+** syntax and spit out a parser that works.
+**
+** The grammar for this looks surprisingly
+** like regex but the main difference is that
+** it is now whitespace insensitive and the
+** base type takes literals of some form.
+*/
+
+/*
+**
+**  ### Grammar Grammar
+**
+**      <grammar> : (<term> "|" <grammar>) | <term>
+**     
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**           
+**      <base> : "<" (<digits> | <ident>) ">"
+**             | <string_lit>
+**             | <char_lit>
+**             | <regex_lit>
+**             | "(" <grammar> ")"
+*/
+
+typedef struct {
+  va_list *va;
+  int parsers_num;
+  mpc_parser_t **parsers;
+  int flags;
+} mpca_grammar_st_t;
+
+static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpca_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_pass();  
+  for (i = 0; i < n; i++) {
+    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+  }
+  return p;
+}
+
+static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) { 
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }  
+  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpca_many(xs[0]); }
+  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpca_many1(xs[0]); }
+  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpca_maybe(xs[0]); }
+  if (strcmp(xs[1], "!") == 0) { free(xs[1]); return mpca_not(xs[0]); }
+  num = *((int*)xs[1]);
+  free(xs[1]);
+  return mpca_count(num, xs[0]);
+}
+
+static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+}
+
+static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+}
+
+static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape_regex(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+}
+
+/* Should this just use `isdigit` instead? */
+static int is_number(const char* s) {
+  size_t i;
+  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+  return 1;
+}
+
+static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+  
+  int i;
+  mpc_parser_t *p;
+  
+  /* Case of Number */
+  if (is_number(x)) {
+
+    i = strtol(x, NULL, 10);
+    
+    while (st->parsers_num <= i) {
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
+      if (st->parsers[st->parsers_num-1] == NULL) {
+        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+      }
+    }
+    
+    return st->parsers[st->parsers_num-1];
+  
+  /* Case of Identifier */
+  } else {
+    
+    /* Search Existing Parsers */
+    for (i = 0; i < st->parsers_num; i++) {
+      mpc_parser_t *q = st->parsers[i];
+      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (q->name && strcmp(q->name, x) == 0) { return q; }
+    }
+    
+    /* Search New Parsers */
+    while (1) {
+    
+      p = va_arg(*st->va, mpc_parser_t*);
+      
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = p;
+      
+      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (p->name && strcmp(p->name, x) == 0) { return p; }
+      
+    }
+  
+  }  
+  
+}
+
+static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+  
+  mpca_grammar_st_t *st = s;
+  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+  free(x);
+
+  if (p->name) {
+    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+  } else {
+    return mpca_state(mpca_root(p));
+  }
+}
+
+mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+  
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+  
+  GrammarTotal = mpc_new("grammar_total");
+  Grammar = mpc_new("grammar");
+  Term = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base = mpc_new("base");
+  
+  mpc_define(GrammarTotal,
+    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
+  );
+  
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+    mpc_soft_delete
+  ));
+  
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
+  
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+  
+  mpc_optimise(GrammarTotal);
+  mpc_optimise(Grammar);
+  mpc_optimise(Factor);
+  mpc_optimise(Term);
+  mpc_optimise(Base);
+  
+  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
+  
+  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+  
+  mpc_optimise(r.output);
+  
+  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  
+}
+
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+  mpca_grammar_st_t st;
+  mpc_parser_t *res;
+  va_list va;
+  va_start(va, grammar);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  res = mpca_grammar_st(grammar, &st);  
+  free(st.parsers);
+  va_end(va);
+  return res;
+}
+
+typedef struct {
+  char *ident;
+  char *name;
+  mpc_parser_t *grammar;
+} mpca_stmt_t;
+
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+  stmt->ident = ((char**)xs)[0];
+  stmt->name = ((char**)xs)[1];
+  stmt->grammar = ((mpc_parser_t**)xs)[3];
+  (void) n;
+  free(((char**)xs)[2]);
+  free(((char**)xs)[4]);
+  
+  return stmt;
+}
+
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+  
+  int i;
+  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+  
+  for (i = 0; i < n; i++) {
+    stmts[i] = xs[i];
+  }
+  stmts[n] = NULL;  
+  
+  return stmts;
+}
+
+static void mpca_stmt_list_delete(mpc_val_t *x) {
+
+  mpca_stmt_t **stmts = x;
+
+  while(*stmts) {
+    mpca_stmt_t *stmt = *stmts; 
+    free(stmt->ident);
+    free(stmt->name);
+    mpc_soft_delete(stmt->grammar);
+    free(stmt);  
+    stmts++;
+  }
+  free(x);
+
+}
+
+static void mpc_optimise_unretained(mpc_parser_t *p, int force);
+static void mpc_analyse(int n, mpc_parser_t **ps);
+
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+
+  mpca_grammar_st_t *st = s;
+  mpca_stmt_t *stmt;
+  mpca_stmt_t **stmts = x;
+  mpc_parser_t *left;
+
+  while(*stmts) {
+    stmt = *stmts;
+    left = mpca_grammar_find_parser(stmt->ident, st);
+    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    mpc_optimise_unretained(stmt->grammar, 1);
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
+    mpc_define(left, stmt->grammar);
+    free(stmt->ident);
+    free(stmt->name);
+    free(stmt);
+    stmts++;
+  }
+  
+  mpc_analyse(st->parsers_num, st->parsers);
+  
+  free(x);
+  
+  return NULL;
+}
+
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+  
+  mpc_result_t r;
+  mpc_err_t *e;
+  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
+  
+  Lang    = mpc_new("lang");
+  Stmt    = mpc_new("stmt");
+  Grammar = mpc_new("grammar");
+  Term    = mpc_new("term");
+  Factor  = mpc_new("factor");
+  Base    = mpc_new("base");
+  
+  mpc_define(Lang, mpc_apply_to(
+    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+    mpca_stmt_list_apply_to, st
+  ));
+  
+  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+    free, free, free, mpc_soft_delete
+  ));
+  
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+      Term,
+      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+      mpc_soft_delete
+  ));
+  
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
+  
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+  
+  mpc_optimise(Lang);
+  mpc_optimise(Stmt);
+  mpc_optimise(Grammar);
+  mpc_optimise(Term);
+  mpc_optimise(Factor);
+  mpc_optimise(Base);
+  
+  if (!mpc_parse_input(i, Lang, &r)) {
+    e = r.error;
+  } else {
+    e = NULL;
+  }
+  
+  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+  
+  return e;
+}
+
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;  
+  va_start(va, f);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_file("<mpca_lang_file>", f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;  
+  va_start(va, p);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  
+  va_list va;  
+  va_start(va, language);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_string("<mpca_lang>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  
+  va_list va;
+
+  FILE *f = fopen(filename, "rb");
+  
+  if (f == NULL) {
+    err = mpc_err_file(filename, "Unable to open file!");
+    return err;
+  }
+  
+  va_start(va, filename);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_file(filename, f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);  
+  
+  fclose(f);
+  
+  return err;
+}
+
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
+
+  int i, total;
+
+  if (p->retained && !force) { return 0; }
+
+  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+
+  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+
+  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+
+  if (p->type == MPC_TYPE_OR) { 
+    total = 0;
+    for(i = 0; i < p->data.or.n; i++) {
+      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+    }
+    return total;
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    total = 0;
+    for(i = 0; i < p->data.and.n; i++) {
+      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+    }
+    return total;
+  }
+
+  return 1;
+  
+}
+
+void mpc_stats(mpc_parser_t* p) {
+  printf("Stats\n");
+  printf("=====\n");
+  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+}
+
+/*
+** Follows the unretained `expect` wrappers of
+** `p`, which the optimiser may then look past.
+*/
+
+static mpc_parser_t *mpc_optimise_unwrap(mpc_parser_t *p) {
+  while (p->type == MPC_TYPE_EXPECT && !p->data.expect.x->retained) {
+    p = p->data.expect.x;
+  }
+  return p;
+}
+
+/*
+** Turns a `char` or `range` into the `oneof`
+** of the same characters, so that a repeat
+** of it can be matched as one run.
+*/
+
+static void mpc_optimise_class(mpc_parser_t *p) {
+  
+  int j, lo, hi;
+  char *s;
+  
+  if (p->type == MPC_TYPE_SINGLE) {
+    lo = (unsigned char)p->data.single.x;
+    hi = lo;
+  } else {
+    lo = (unsigned char)p->data.range.x;
+    hi = (unsigned char)p->data.range.y;
+  }
+  
+  s = malloc(hi >= lo ? hi - lo + 2 : 1);
+  for (j = lo; j <= hi; j++) { s[j - lo] = (char)j; }
+  s[hi >= lo ? hi - lo + 1 : 0] = '\0';
+  
+  p->type = MPC_TYPE_ONEOF;
+  p->data.string.x = s;
+  p->data.string.c = mpc_class_new(s, 0);
+}
+
+static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+  
+  int i, n, m;
+  mpc_parser_t *t;
+  
+  if (p->retained && !force) { return; }
+  
+  mpc_program_release(p);
+  free(p->profile);
+  p->profile = NULL;
+  
+  /* Optimise Subexpressions */
+  
+  if (p->type == MPC_TYPE_EXPECT)   { mpc_optimise_unretained(p->data.expect.x, 0); }
+  if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_optimise_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  
+  if (p->type == MPC_TYPE_OR) { 
+    for(i = 0; i < p->data.or.n; i++) {
+      mpc_optimise_unretained(p->data.or.xs[i], 0);
+    }
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    for(i = 0; i < p->data.and.n; i++) {
+      mpc_optimise_unretained(p->data.and.xs[i], 0);
+    }
+  }  
+  
+  /* Perform optimisations */
+  
+  while (1) {
+    
+    /* Merge rhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
+    && !p->data.or.xs[p->data.or.n-1]->retained) {
+      t = p->data.or.xs[p->data.or.n-1];
+      n = p->data.or.n; m = t->data.or.n;
+      mpc_dispatch_delete(p->data.or.dispatch); p->data.or.dispatch = NULL;
+      mpc_dispatch_delete(t->data.or.dispatch);
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->name); free(t);
+      continue;
+    }
+
+    /* Merge lhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
+    && !p->data.or.xs[0]->retained) {
+      t = p->data.or.xs[0];
+      n = p->data.or.n; m = t->data.or.n;
+      mpc_dispatch_delete(p->data.or.dispatch); p->data.or.dispatch = NULL;
+      mpc_dispatch_delete(t->data.or.dispatch);
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
+      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->name); free(t);
+      continue;
+    }
+    
+    /* Remove ast `pass` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      memcpy(p, t, sizeof(mpc_parser_t));
+      free(t);
+      continue;
+    }
+    
+    /* Merge ast lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
+    }
+    
+    /* Merge ast rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
+    }
+
+    /* Remove re `lift` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
+    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      memcpy(p, t, sizeof(mpc_parser_t));
+      free(t);
+      continue;
+    }
+
+    /* Merge re lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
+    }
+    
+    /* Merge re rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
+    }
+    
+    /* Widen re repeated `char` or `range` */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    && !p->data.repeat.x->retained) {
+      t = mpc_optimise_unwrap(p->data.repeat.x);
+      if ((t->type == MPC_TYPE_SINGLE && t->data.single.x != '\0')
+      ||  (t->type == MPC_TYPE_RANGE  && t->data.range.x  != '\0')) {
+        mpc_optimise_class(t);
+        continue;
+      }
+    }
+    
+    /* Discard freed re repeat */
+    if (p->type == MPC_TYPE_APPLY
+    &&  p->data.apply.f == mpcf_free
+    && !p->data.apply.x->retained) {
+      t = mpc_optimise_unwrap(p->data.apply.x);
+      if ((t->type == MPC_TYPE_MANY || t->type == MPC_TYPE_MANY1)
+      && !t->retained
+      &&  mpc_parse_spans(t)) {
+        t->data.repeat.f = mpcf_discard;
+        t = p->data.apply.x;
+        free(t->name);
+        t->name = p->name;
+        t->retained = p->retained;
+        memcpy(p, t, sizeof(mpc_parser_t));
+        free(t);
+        continue;
+      }
+    }
+    
+    return;
+    
+  }
+  
+}
+
 /*
+** Grammar Analysis
 **
-**  ### Grammar Grammar
-**
-**      <grammar> : (<term> "|" <grammar>) | <term>
-**     
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**           
-**      <base> : "<" (<digits> | <ident>) ">"
-**             | <string_lit>
-**             | <char_lit>
-**             | <regex_lit>
-**             | "(" <grammar> ")"
+** Works out, for every parser reachable from
+** the roots given, the bytes it can start with
+** and whether it can match without consuming
+** any input. Grammars are usually recursive so
+** this is repeated until nothing changes. What
+** cannot be known, such as the bytes accepted
+** by a `satisfy` function, is taken to be any
+** byte. The results are used to build the
+** dispatch table of each `or`.
 */
 
-typedef struct {
-  va_list *va;
-  int parsers_num;
-  mpc_parser_t **parsers;
-  int flags;
-} mpca_grammar_st_t;
+struct mpc_analysis_t {
+  int num;
+  int slots;
+  mpc_parser_t **nodes;
+  int index_slots;
+  int *index;
+  unsigned char *first;
+  char *nullable;
+};
 
-static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpca_or(2, xs[0], xs[1]); }
+static int mpc_analysis_children(mpc_parser_t *p, mpc_parser_t ***xs) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   *xs = &p->data.expect.x;   return 1;
+    case MPC_TYPE_APPLY:    *xs = &p->data.apply.x;    return 1;
+    case MPC_TYPE_APPLY_TO: *xs = &p->data.apply_to.x; return 1;
+    case MPC_TYPE_PREDICT:  *xs = &p->data.predict.x;  return 1;
+    case MPC_TYPE_MEMO:     *xs = &p->data.memo.x;     return 1;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    *xs = &p->data.not.x;      return 1;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    *xs = &p->data.repeat.x;   return 1;
+    case MPC_TYPE_OR:       *xs = p->data.or.xs;       return p->data.or.n;
+    case MPC_TYPE_AND:      *xs = p->data.and.xs;      return p->data.and.n;
+    default: return 0;
+  }
 }
 
-static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_pass();  
-  for (i = 0; i < n; i++) {
-    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
-  }
-  return p;
+static size_t mpc_analysis_hash(mpc_analysis_t *a, mpc_parser_t *p) {
+  return (((size_t)p / sizeof(void*)) * 2654435761UL) & (a->index_slots - 1);
 }
 
-static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) { 
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }  
-  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpca_many(xs[0]); }
-  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpca_many1(xs[0]); }
-  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpca_maybe(xs[0]); }
-  if (strcmp(xs[1], "!") == 0) { free(xs[1]); return mpca_not(xs[0]); }
-  num = *((int*)xs[1]);
-  free(xs[1]);
-  return mpca_count(num, xs[0]);
+static int mpc_analysis_find(mpc_analysis_t *a, mpc_parser_t *p) {
+  size_t h = mpc_analysis_hash(a, p);
+  while (a->index[h]) {
+    if (a->nodes[a->index[h]-1] == p) { return a->index[h]-1; }
+    h = (h + 1) & (a->index_slots - 1);
+  }
+  return -1;
 }
 
-static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+static void mpc_analysis_index(mpc_analysis_t *a, int k) {
+  size_t h = mpc_analysis_hash(a, a->nodes[k]);
+  while (a->index[h]) { h = (h + 1) & (a->index_slots - 1); }
+  a->index[h] = k+1;
 }
 
-static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+static void mpc_analysis_add(mpc_analysis_t *a, mpc_parser_t *p) {
+  
+  int k;
+  
+  if (p == NULL || mpc_analysis_find(a, p) >= 0) { return; }
+  
+  if (a->num == a->slots) {
+    a->slots *= 2;
+    a->nodes = realloc(a->nodes, sizeof(mpc_parser_t*) * a->slots);
+  }
+  a->nodes[a->num++] = p;
+  
+  if (a->num * 2 <= a->index_slots) {
+    mpc_analysis_index(a, a->num-1);
+    return;
+  }
+  
+  a->index_slots *= 2;
+  a->index = realloc(a->index, sizeof(int) * a->index_slots);
+  memset(a->index, 0, sizeof(int) * a->index_slots);
+  for (k = 0; k < a->num; k++) { mpc_analysis_index(a, k); }
 }
 
-static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape_regex(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+static void mpc_analysis_set(unsigned char *f, char c) {
+  f[(unsigned char)c / 8] |= 1 << ((unsigned char)c % 8);
 }
 
-/* Should this just use `isdigit` instead? */
-static int is_number(const char* s) {
-  size_t i;
-  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
-  return 1;
+static int mpc_analysis_first(mpc_analysis_t *a, unsigned char *f, mpc_parser_t *x) {
+  int j, k = mpc_analysis_find(a, x);
+  for (j = 0; j < 32; j++) { f[j] |= a->first[k * 32 + j]; }
+  return a->nullable[k];
 }
 
-static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+static int mpc_analysis_step(mpc_analysis_t *a, int k) {
   
-  int i;
-  mpc_parser_t *p;
+  int j, n, changed;
+  unsigned char f[32];
+  char nullable = 0;
+  mpc_parser_t **xs;
+  mpc_parser_t *p = a->nodes[k];
   
-  /* Case of Number */
-  if (is_number(x)) {
-
-    i = strtol(x, NULL, 10);
+  memset(f, 0, 32);
+  n = mpc_analysis_children(p, &xs);
+  
+  switch (p->type) {
     
-    while (st->parsers_num <= i) {
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
-      if (st->parsers[st->parsers_num-1] == NULL) {
-        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      memset(f, 0xFF, 32);
+      break;
+    
+    case MPC_TYPE_SINGLE: mpc_analysis_set(f, p->data.single.x); break;
+    
+    case MPC_TYPE_RANGE:
+      for (j = 0; j < 256; j++) {
+        if ((char)j >= p->data.range.x && (char)j <= p->data.range.y) { mpc_analysis_set(f, (char)j); }
       }
-    }
+      break;
     
-    return st->parsers[st->parsers_num-1];
-  
-  /* Case of Identifier */
-  } else {
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      memcpy(f, p->data.string.c->set, 32);
+      break;
     
-    /* Search Existing Parsers */
-    for (i = 0; i < st->parsers_num; i++) {
-      mpc_parser_t *q = st->parsers[i];
-      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (q->name && strcmp(q->name, x) == 0) { return q; }
-    }
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { mpc_analysis_set(f, p->data.string.x[0]); }
+      else { nullable = 1; }
+      break;
     
-    /* Search New Parsers */
-    while (1) {
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_NOT:
+      nullable = 1;
+      break;
     
-      p = va_arg(*st->va, mpc_parser_t*);
-      
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = p;
-      
-      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (p->name && strcmp(p->name, x) == 0) { return p; }
-      
-    }
-  
-  }  
-  
-}
-
-static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_MANY1:
+      nullable = mpc_analysis_first(a, f, xs[0]);
+      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+      mpc_analysis_first(a, f, xs[0]);
+      nullable = 1;
+      break;
+    
+    case MPC_TYPE_COUNT:
+      nullable = mpc_analysis_first(a, f, xs[0]) || p->data.repeat.n == 0;
+      break;
+    
+    case MPC_TYPE_OR:
+      nullable = n == 0;
+      for (j = 0; j < n; j++) {
+        if (mpc_analysis_first(a, f, xs[j])) { nullable = 1; }
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      nullable = 1;
+      for (j = 0; j < n && nullable; j++) {
+        nullable = mpc_analysis_first(a, f, xs[j]);
+      }
+      break;
+    
+    /* Undefined and failing parsers are always tried, for their errors */
+    
+    default:
+      memset(f, 0xFF, 32);
+      nullable = 1;
+      break;
+  }
   
-  mpca_grammar_st_t *st = s;
-  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
-  free(x);
-
-  if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-  } else {
-    return mpca_state(mpca_root(p));
+  changed = nullable && !a->nullable[k];
+  a->nullable[k] |= nullable;
+  for (j = 0; j < 32; j++) {
+    if (f[j] & ~a->first[k * 32 + j]) { changed = 1; }
+    a->first[k * 32 + j] |= f[j];
   }
+  
+  return changed;
 }
 
-mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
-  
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
-  
-  GrammarTotal = mpc_new("grammar_total");
-  Grammar = mpc_new("grammar");
-  Term = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base = mpc_new("base");
-  
-  mpc_define(GrammarTotal,
-    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
-  );
-  
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-    mpc_soft_delete
-  ));
-  
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
-  
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
-  
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
-  
-  mpc_optimise(GrammarTotal);
-  mpc_optimise(Grammar);
-  mpc_optimise(Factor);
-  mpc_optimise(Term);
-  mpc_optimise(Base);
+static void mpc_analysis_dispatch(mpc_analysis_t *a, mpc_parser_t *p) {
   
-  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
-  }
+  int j, k, c;
+  mpc_dispatch_t *d;
   
-  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+  /* A table still there is up to date, and may be in use */
+  if (p->data.or.dispatch) { return; }
   
-  mpc_optimise(r.output);
+  /* The first alternative is tried at any byte */
+  if (p->data.or.n == 0 || a->nullable[mpc_analysis_find(a, p->data.or.xs[0])]) { return; }
   
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  d = malloc(sizeof(mpc_dispatch_t));
+  d->viable = malloc(p->data.or.n * 32);
   
-}
-
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
-  mpca_grammar_st_t st;
-  mpc_parser_t *res;
-  va_list va;
-  va_start(va, grammar);
+  for (j = 0; j < p->data.or.n; j++) {
+    k = mpc_analysis_find(a, p->data.or.xs[j]);
+    if (a->nullable[k]) { memset(d->viable + j * 32, 0xFF, 32); }
+    else { memcpy(d->viable + j * 32, a->first + k * 32, 32); }
+  }
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  for (c = 0; c < 256; c++) {
+    d->start[c] = p->data.or.n;
+    for (j = 0; j < p->data.or.n; j++) {
+      if (mpc_dispatch_viable(d, j, (char)c)) { d->start[c] = j; break; }
+    }
+  }
   
-  res = mpca_grammar_st(grammar, &st);  
-  free(st.parsers);
-  va_end(va);
-  return res;
+  p->data.or.dispatch = d;
 }
 
-typedef struct {
-  char *ident;
-  char *name;
-  mpc_parser_t *grammar;
-} mpca_stmt_t;
-
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
-  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-  stmt->ident = ((char**)xs)[0];
-  stmt->name = ((char**)xs)[1];
-  stmt->grammar = ((mpc_parser_t**)xs)[3];
-  (void) n;
-  free(((char**)xs)[2]);
-  free(((char**)xs)[4]);
+static void mpc_analysis_collect(mpc_analysis_t *a, int n, mpc_parser_t **ps) {
   
-  return stmt;
+  int j, k, m;
+  mpc_parser_t **xs;
+  
+  a->num = 0;
+  a->slots = 64;
+  a->nodes = malloc(sizeof(mpc_parser_t*) * a->slots);
+  a->index_slots = 128;
+  a->index = calloc(a->index_slots, sizeof(int));
+  
+  for (j = 0; j < n; j++) { mpc_analysis_add(a, ps[j]); }
+  for (k = 0; k < a->num; k++) {
+    m = mpc_analysis_children(a->nodes[k], &xs);
+    for (j = 0; j < m; j++) { mpc_analysis_add(a, xs[j]); }
+  }
 }
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+static void mpc_analyse(int n, mpc_parser_t **ps) {
   
-  int i;
-  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+  int k, changed;
+  mpc_analysis_t a;
   
-  for (i = 0; i < n; i++) {
-    stmts[i] = xs[i];
+  mpc_analysis_collect(&a, n, ps);
+  
+  a.first = calloc(a.num, 32);
+  a.nullable = calloc(a.num, 1);
+  
+  do {
+    changed = 0;
+    for (k = a.num-1; k >= 0; k--) { changed |= mpc_analysis_step(&a, k); }
+  } while (changed);
+  
+  for (k = 0; k < a.num; k++) {
+    if (a.nodes[k]->type == MPC_TYPE_OR) { mpc_analysis_dispatch(&a, a.nodes[k]); }
   }
-  stmts[n] = NULL;  
   
-  return stmts;
+  free(a.nodes);
+  free(a.index);
+  free(a.first);
+  free(a.nullable);
 }
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
+/*
+** Optimising also analyses the grammar, so
+** must be done again after redefining any part
+** of it for the `or`s reaching that part to
+** dispatch on the next byte. Only the programs
+** reaching `p` are compiled again, as tables
+** are only added. `p` is compiled too, so that
+** every analysed `or` is in a program and can
+** be found when dropping its table.
+*/
 
-  mpca_stmt_t **stmts = x;
+void mpc_optimise(mpc_parser_t *p) {
+  int n;
+  mpc_program_t **gs = mpc_program_stale(1, &p, &n);
+  mpc_optimise_unretained(p, 1);
+  mpc_analyse(1, &p);
+  mpc_program_refresh(gs, n);
+  if (p->program == NULL) { mpc_compile(p); }
+}
 
-  while(*stmts) {
-    mpca_stmt_t *stmt = *stmts; 
-    free(stmt->ident);
-    free(stmt->name);
-    mpc_soft_delete(stmt->grammar);
-    free(stmt);  
-    stmts++;
-  }
-  free(x);
+/*
+** Any `or` reaching `p` is in some program that
+** reaches `p`, so just those are searched. This
+** runs before `p` changes, while the parsers
+** the programs were compiled from all exist.
+*/
 
+static void mpc_dispatch_invalidate(mpc_program_t **gs, int num, mpc_parser_t *p) {
+  
+  int j, k, m, n, changed;
+  char *reach;
+  mpc_parser_t **xs;
+  mpc_analysis_t *a;
+  
+  for (j = 0; j < num; j++) {
+    
+    a = gs[j]->graph;
+    reach = calloc(a->num, 1);
+    reach[mpc_analysis_find(a, p)] = 1;
+    
+    do {
+      changed = 0;
+      for (k = a->num-1; k >= 0; k--) {
+        if (reach[k]) { continue; }
+        n = mpc_analysis_children(a->nodes[k], &xs);
+        for (m = 0; m < n && !reach[k]; m++) { reach[k] = reach[mpc_analysis_find(a, xs[m])]; }
+        changed |= reach[k];
+      }
+    } while (changed);
+    
+    for (k = 0; k < a->num; k++) {
+      if (!reach[k] || a->nodes[k]->type != MPC_TYPE_OR) { continue; }
+      mpc_dispatch_delete(a->nodes[k]->data.or.dispatch);
+      a->nodes[k]->data.or.dispatch = NULL;
+    }
+    
+    free(reach);
+  }
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
-
-  mpca_grammar_st_t *st = s;
-  mpca_stmt_t *stmt;
-  mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+/*
+** Compiling
+**
+** The parsers are numbered as the analysis
+** finds them, the root first, and parser `k`
+** becomes instruction `k`. `expect` is fused
+** once every instruction has been filled in,
+** as the primitive it wraps may come later.
+*/
 
-  while(*stmts) {
-    stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
-    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_optimise(stmt->grammar);
-    mpc_define(left, stmt->grammar);
-    free(stmt->ident);
-    free(stmt->name);
-    free(stmt);
-    stmts++;
+static int mpc_compile_primitive(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_ANCHOR:
+      return 1;
+    default: return 0;
   }
-  
-  free(x);
-  
-  return NULL;
 }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
-  
-  mpc_result_t r;
-  mpc_err_t *e;
-  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
-  
-  Lang    = mpc_new("lang");
-  Stmt    = mpc_new("stmt");
-  Grammar = mpc_new("grammar");
-  Term    = mpc_new("term");
-  Factor  = mpc_new("factor");
-  Base    = mpc_new("base");
-  
-  mpc_define(Lang, mpc_apply_to(
-    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-    mpca_stmt_list_apply_to, st
-  ));
-  
-  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-    free, free, free, mpc_soft_delete
-  ));
-  
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-      Term,
-      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-      mpc_soft_delete
-  ));
+static void mpc_compile_inst(mpc_analysis_t *a, mpc_program_t *g, int k, int *edges) {
   
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
-  
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+  int j, n;
+  char *m;
+  mpc_parser_t **xs, *q;
+  mpc_parser_t *p = a->nodes[k];
+  mpc_inst_t *c = &g->code[k];
   
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+  c->type = p->type;
+  c->p = p;
+  c->profile = p->profile;
+  g->profiled |= p->profile != NULL;
   
-  mpc_optimise(Lang);
-  mpc_optimise(Stmt);
-  mpc_optimise(Grammar);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
+  n = mpc_analysis_children(p, &xs);
+  if (n == 1) { c->x = &g->code[mpc_analysis_find(a, xs[0])]; }
   
-  if (!mpc_parse_input(i, Lang, &r)) {
-    e = r.error;
-  } else {
-    e = NULL;
+  switch (p->type) {
+    
+    case MPC_TYPE_SINGLE: c->a = p->data.single.x; break;
+    case MPC_TYPE_RANGE:  c->a = p->data.range.x; c->b = p->data.range.y; break;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF: c->c = p->data.string.c; break;
+    case MPC_TYPE_STRING: c->s = p->data.string.x; break;
+    case MPC_TYPE_EXPECT: c->m = p->data.expect.m; break;
+    case MPC_TYPE_COUNT:  c->n = p->data.repeat.n; break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (!mpc_parse_spans(p)) { break; }
+      q = mpc_parse_span_class(p, &m);
+      c->type = MPC_TYPE_SPAN;
+      c->c = q->data.string.c;
+      c->m = m;
+      c->min = p->type == MPC_TYPE_MANY1;
+      c->discard = p->data.repeat.f == mpcf_discard;
+      break;
+    
+    case MPC_TYPE_OR:
+    case MPC_TYPE_AND:
+      c->n = n;
+      c->xs = g->edges + *edges;
+      for (j = 0; j < n; j++) { c->xs[j] = &g->code[mpc_analysis_find(a, xs[j])]; }
+      *edges += n;
+      if (p->type == MPC_TYPE_OR) { c->dispatch = p->data.or.dispatch; }
+      break;
+    
+    default: break;
   }
   
-  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
-  
-  return e;
 }
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
-
-  va_list va;  
-  va_start(va, f);
-  
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
-  
-  i = mpc_input_new_file("<mpca_lang_file>", f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
-  
-  free(st.parsers);
-  va_end(va);
-  return err;
+static void mpc_program_delete(mpc_program_t *g) {
+  if (g->prev) { g->prev->next = g->next; } else if (mpc_programs == g) { mpc_programs = g->next; }
+  if (g->next) { g->next->prev = g->prev; }
+  free(g->code);
+  free(g->edges);
+  free(g->graph->nodes);
+  free(g->graph->index);
+  free(g->graph);
+  free(g->users);
+  free(g);
 }
 
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
-
-  va_list va;  
-  va_start(va, p);
-  
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
-  
-  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
-  
-  free(st.parsers);
-  va_end(va);
-  return err;
+static void mpc_program_use(mpc_program_t *g, mpc_parser_t *p, int entry) {
+  mpc_program_release(p);
+  g->users[g->users_num++] = p;
+  p->program = g;
+  p->entry = entry;
 }
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+/*
+** A program cannot outlive the parser it was
+** compiled from, which may be about to go, so
+** once that parser leaves it any others still
+** using it are compiled again.
+*/
+
+static void mpc_program_release(mpc_parser_t *p) {
   
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+  int j;
+  mpc_program_t **gs;
+  mpc_program_t *g = p->program;
   
-  va_list va;  
-  va_start(va, language);
+  if (g == NULL) { return; }
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  for (j = 0; g->users[j] != p; j++);
+  memmove(g->users + j, g->users + j + 1, sizeof(mpc_parser_t*) * (g->users_num - j - 1));
+  g->users_num--;
+  p->program = NULL;
   
-  i = mpc_input_new_string("<mpca_lang>", language);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  if (g->stale) { return; }
+  if (g->users_num == 0) { mpc_program_delete(g); return; }
+  if (g->graph->nodes[0] != p) { return; }
   
-  free(st.parsers);
-  va_end(va);
-  return err;
+  g->stale = 1;
+  gs = malloc(sizeof(mpc_program_t*));
+  gs[0] = g;
+  mpc_program_refresh(gs, 1);
 }
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+/*
+** Finds the programs reaching any of the given
+** parsers, before they are changed, and marks
+** them stale so they are kept until refreshed.
+*/
+
+static mpc_program_t **mpc_program_stale(int n, mpc_parser_t **ps, int *num) {
   
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+  int j;
+  mpc_program_t *g;
+  mpc_program_t **gs = NULL;
+  
+  *num = 0;
+  for (g = mpc_programs; g; g = g->next) {
+    for (j = 0; j < n; j++) {
+      if (mpc_analysis_find(g->graph, ps[j]) < 0) { continue; }
+      g->stale = 1;
+      gs = realloc(gs, sizeof(mpc_program_t*) * (*num + 1));
+      gs[(*num)++] = g;
+      break;
+    }
+  }
   
-  va_list va;
+  return gs;
+}
+
+/*
+** Compiles again for every parser still using
+** a stale program, the root first, as the new
+** program takes over the others it reaches.
+*/
+
+static void mpc_program_refresh(mpc_program_t **gs, int num) {
+  int j;
+  for (j = 0; j < num; j++) {
+    while (gs[j]->users_num > 0) { mpc_compile(gs[j]->users[0]); }
+  }
+  for (j = 0; j < num; j++) { mpc_program_delete(gs[j]); }
+  free(gs);
+}
 
-  FILE *f = fopen(filename, "rb");
+static mpc_program_t *mpc_program_new(mpc_parser_t *p) {
   
-  if (f == NULL) {
-    err = mpc_err_file(filename, "Unable to open file!");
-    return err;
+  int k, n, edges = 0;
+  mpc_parser_t **xs, *q;
+  mpc_analysis_t *a;
+  mpc_program_t *g;
+  
+  a = malloc(sizeof(mpc_analysis_t));
+  mpc_analysis_collect(a, 1, &p);
+  
+  for (k = 0; k < a->num; k++) {
+    n = mpc_analysis_children(a->nodes[k], &xs);
+    if (a->nodes[k]->type == MPC_TYPE_OR || a->nodes[k]->type == MPC_TYPE_AND) { edges += n; }
   }
   
-  va_start(va, filename);
+  g = malloc(sizeof(mpc_program_t));
+  g->stale = 0;
+  g->profiled = 0;
+  g->num = a->num;
+  g->code = calloc((unsigned)a->num, sizeof(mpc_inst_t));
+  g->edges = malloc(sizeof(mpc_inst_t*) * (edges > 0 ? edges : 1));
+  g->graph = a;
+  g->users_num = 0;
+  g->users = malloc(sizeof(mpc_parser_t*) * a->num);
+  
+  edges = 0;
+  for (k = 0; k < a->num; k++) { mpc_compile_inst(a, g, k, &edges); }
+  
+  for (k = 0; k < a->num; k++) {
+    if (a->nodes[k]->type != MPC_TYPE_EXPECT) { continue; }
+    q = a->nodes[k];
+    while (q->type == MPC_TYPE_EXPECT) { q = q->data.expect.x; }
+    if (!mpc_compile_primitive(q)) { continue; }
+    g->code[k] = g->code[mpc_analysis_find(a, q)];
+    g->code[k].m = a->nodes[k]->data.expect.m;
+    g->code[k].profile = a->nodes[k]->profile;
+  }
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  g->prev = NULL;
+  g->next = NULL;
+  return g;
+}
+
+void mpc_compile(mpc_parser_t *p) {
   
-  i = mpc_input_new_file(filename, f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  int k;
+  mpc_parser_t *q;
+  mpc_program_t *g = mpc_program_new(p), **old = NULL;
+  mpc_analysis_t *a = g->graph;
   
-  free(st.parsers);
-  va_end(va);  
+  g->next = mpc_programs;
+  if (mpc_programs) { mpc_programs->prev = g; }
+  mpc_programs = g;
   
-  fclose(f);
+  /* The users of a program compiled from `p` before move here if they can */
+  if (p->program && !p->program->stale && p->program->graph->nodes[0] == p) {
+    old = malloc(sizeof(mpc_program_t*));
+    old[0] = p->program;
+    old[0]->stale = 1;
+  }
   
-  return err;
+  /* Retained parsers without a program of their own take this one */
+  mpc_program_use(g, p, 0);
+  for (k = 1; k < a->num; k++) {
+    q = a->nodes[k];
+    if (q->retained && (q->program == NULL || q->program->stale)) { mpc_program_use(g, q, k); }
+  }
+  
+  if (old) { mpc_program_refresh(old, 1); }
 }
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
-
-  int i, total;
 
-  if (p->retained && !force) { return 0; }
+/*
+** Profiling
+**
+** Parsers without a name are labelled by their
+** kind and by the named parser they were first
+** found in, searching out from the root.
+*/
 
-  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+typedef struct {
+  mpc_parser_t *p;
+  mpc_parser_t *owner;
+} mpc_profile_row_t;
 
-  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+static void mpc_profile_set(mpc_parser_t *p, int enable) {
+  
+  int k, stale;
+  mpc_analysis_t a;
+  mpc_parser_t *q;
+  mpc_program_t **gs;
+  
+  mpc_analysis_collect(&a, 1, &p);
+  gs = mpc_program_stale(a.num, a.nodes, &stale);
+  
+  for (k = 0; k < a.num; k++) {
+    q = a.nodes[k];
+    if (!enable) {
+      free(q->profile);
+      q->profile = NULL;
+      continue;
+    }
+    if (q->profile == NULL) { q->profile = malloc(sizeof(mpc_profile_t)); }
+    mpc_profile_lock(1);
+    memset(q->profile, 0, sizeof(mpc_profile_t));
+    mpc_profile_lock(0);
+  }
+  
+  mpc_program_refresh(gs, stale);
+  
+  free(a.nodes);
+  free(a.index);
+}
 
-  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+void mpc_profile(mpc_parser_t *p) { mpc_profile_set(p, 1); }
+void mpc_profile_stop(mpc_parser_t *p) { mpc_profile_set(p, 0); }
 
-  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+static int mpc_profile_cmp(const void *a, const void *b) {
+  double x = ((const mpc_profile_row_t*)a)->p->profile->exclusive;
+  double y = ((const mpc_profile_row_t*)b)->p->profile->exclusive;
+  return (x < y) - (x > y);
+}
 
-  if (p->type == MPC_TYPE_OR) { 
-    total = 0;
-    for(i = 0; i < p->data.or.n; i++) {
-      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+static mpc_profile_row_t *mpc_profile_rows(mpc_parser_t *p, int *num) {
+  
+  int j, k, n, c;
+  int *owners;
+  mpc_parser_t **xs;
+  mpc_analysis_t a;
+  mpc_profile_row_t *rows;
+  
+  mpc_analysis_collect(&a, 1, &p);
+  
+  owners = malloc(sizeof(int) * a.num);
+  for (k = 0; k < a.num; k++) { owners[k] = -1; }
+  for (k = 0; k < a.num; k++) {
+    n = mpc_analysis_children(a.nodes[k], &xs);
+    for (j = 0; j < n; j++) {
+      c = mpc_analysis_find(&a, xs[j]);
+      if (c > k && owners[c] < 0) { owners[c] = a.nodes[k]->name ? k : owners[k]; }
     }
-    return total;
   }
   
-  if (p->type == MPC_TYPE_AND) {
-    total = 0;
-    for(i = 0; i < p->data.and.n; i++) {
-      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
-    }
-    return total;
+  rows = malloc(sizeof(mpc_profile_row_t) * a.num);
+  *num = 0;
+  for (k = 0; k < a.num; k++) {
+    if (a.nodes[k]->profile == NULL || a.nodes[k]->profile->calls == 0) { continue; }
+    rows[*num].p = a.nodes[k];
+    rows[*num].owner = owners[k] >= 0 ? a.nodes[owners[k]] : NULL;
+    (*num)++;
   }
-
-  return 1;
   
+  qsort(rows, *num, sizeof(mpc_profile_row_t), mpc_profile_cmp);
+  
+  free(owners);
+  free(a.nodes);
+  free(a.index);
+  return rows;
 }
 
-void mpc_stats(mpc_parser_t* p) {
-  printf("Stats\n");
-  printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+static void mpc_profile_puts(FILE *f, const char *s, int json) {
+  for (; *s; s++) {
+    if (json && (*s == '"' || *s == '\\')) { fprintf(f, "\\%c", *s); }
+    else if (json && (unsigned char)*s < 0x20) { fprintf(f, "\\u%04x", (unsigned char)*s); }
+    else { fputc(*s, f); }
+  }
 }
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+static void mpc_profile_label(FILE *f, mpc_profile_row_t *row, int json) {
   
-  int i, n, m;
-  mpc_parser_t *t;
+  static const char *kinds[] = {
+    "undefined", "pass", "fail", "lift", "lift_val", "expect", "anchor", "state",
+    "any", "char", "oneof", "noneof", "range", "satisfy", "string",
+    "apply", "apply_to", "predict", "not", "maybe", "many", "many1", "count",
+    "or", "and", "memo"
+  };
   
-  if (p->retained && !force) { return; }
+  mpc_parser_t *p = row->p, *q = row->p;
+  mpc_parser_t **xs;
+  const char *open = NULL, *close = NULL;
+  char *s = NULL;
+  char buff[4];
   
-  /* Optimise Subexpressions */
+  if (p->name) {
+    mpc_profile_puts(f, p->name, json);
+    return;
+  }
   
-  if (p->type == MPC_TYPE_EXPECT)   { mpc_optimise_unretained(p->data.expect.x, 0); }
-  if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
-  if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  fputs(kinds[(int)p->type], f);
   
-  if (p->type == MPC_TYPE_OR) { 
-    for(i = 0; i < p->data.or.n; i++) {
-      mpc_optimise_unretained(p->data.or.xs[i], 0);
-    }
+  /* Wrappers are told apart by what they wrap */
+  while (!q->name && q->type != MPC_TYPE_EXPECT && mpc_analysis_children(q, &xs) == 1) {
+    q = xs[0];
   }
   
-  if (p->type == MPC_TYPE_AND) {
-    for(i = 0; i < p->data.and.n; i++) {
-      mpc_optimise_unretained(p->data.and.xs[i], 0);
-    }
-  }  
+  switch (q->type) {
+    case MPC_TYPE_SINGLE:
+      buff[0] = q->data.single.x; buff[1] = '\0';
+      open = "'"; close = "'"; s = buff;
+      break;
+    case MPC_TYPE_RANGE:
+      buff[0] = q->data.range.x; buff[1] = '-'; buff[2] = q->data.range.y; buff[3] = '\0';
+      open = "["; close = "]"; s = buff;
+      break;
+    case MPC_TYPE_ONEOF:  open = "[";  close = "]";  s = q->data.string.x; break;
+    case MPC_TYPE_NONEOF: open = "[^"; close = "]";  s = q->data.string.x; break;
+    case MPC_TYPE_STRING: open = "\""; close = "\""; s = q->data.string.x; break;
+    default: break;
+  }
   
-  /* Perform optimisations */
+  if (q != p && q->name) {
+    fputs(" <", f);
+    mpc_profile_puts(f, q->name, json);
+    fputs(">", f);
+  }
   
-  while (1) {
-    
-    /* Merge rhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
-    && !p->data.or.xs[p->data.or.n-1]->retained) {
-      t = p->data.or.xs[p->data.or.n-1];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
-    }
-
-    /* Merge lhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
-    && !p->data.or.xs[0]->retained) {
-      t = p->data.or.xs[0];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
-      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
-    }
-    
-    /* Remove ast `pass` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
-    }
-    
-    /* Merge ast lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
-    }
-    
-    /* Merge ast rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
-    }
-
-    /* Remove re `lift` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
-    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
-    }
-
-    /* Merge re lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
-    }
-    
-    /* Merge re rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
-    }
-    
-    return;
-    
+  if (q->type == MPC_TYPE_EXPECT) {
+    fputc(' ', f);
+    mpc_profile_puts(f, q->data.expect.m, json);
+  }
+  
+  if (s) {
+    s = mpcf_escape_new(s, mpc_escape_input_c, mpc_escape_output_c);
+    fputc(' ', f);
+    mpc_profile_puts(f, open, json);
+    mpc_profile_puts(f, s, json);
+    mpc_profile_puts(f, close, json);
+    free(s);
   }
   
+  if (row->owner) {
+    fputs(" in ", f);
+    mpc_profile_puts(f, row->owner->name, json);
+  }
 }
 
-void mpc_optimise(mpc_parser_t *p) {
-  mpc_optimise_unretained(p, 1);
+void mpc_profile_print(mpc_parser_t *p, FILE *f) {
+  
+  int k, n;
+  mpc_profile_t *s;
+  mpc_profile_row_t *rows;
+  
+  mpc_profile_lock(1);
+  rows = mpc_profile_rows(p, &n);
+  
+  fprintf(f, "Profile\n");
+  fprintf(f, "=======\n");
+  fprintf(f, "%10s %10s %10s %10s %10s %10s %10s %10s  %s\n",
+    "calls", "ok", "fail", "bytes", "rescanned", "allocs", "total ms", "self ms", "parser");
+  
+  for (k = 0; k < n; k++) {
+    s = rows[k].p->profile;
+    fprintf(f, "%10ld %10ld %10ld %10ld %10ld %10ld %10.3f %10.3f  ",
+      s->calls, s->successes, s->failures, s->consumed, s->rescanned, s->allocs,
+      s->inclusive / 1e6, s->exclusive / 1e6);
+    mpc_profile_label(f, &rows[k], 0);
+    fputc('\n', f);
+  }
+  
+  mpc_profile_lock(0);
+  free(rows);
 }
 
+void mpc_profile_print_json(mpc_parser_t *p, FILE *f) {
+  
+  int k, n;
+  mpc_profile_t *s;
+  mpc_profile_row_t *rows;
+  
+  mpc_profile_lock(1);
+  rows = mpc_profile_rows(p, &n);
+  
+  fprintf(f, "{\"parsers\": [");
+  
+  for (k = 0; k < n; k++) {
+    s = rows[k].p->profile;
+    fprintf(f, "%s\n  {\"parser\": \"", k > 0 ? "," : "");
+    mpc_profile_label(f, &rows[k], 1);
+    fprintf(f, "\", \"named\": %s, \"calls\": %ld, \"successes\": %ld, \"failures\": %ld,"
+      " \"consumed\": %ld, \"rescanned\": %ld, \"allocs\": %ld,"
+      " \"inclusive_ns\": %.0f, \"exclusive_ns\": %.0f}",
+      rows[k].p->name ? "true" : "false",
+      s->calls, s->successes, s->failures, s->consumed, s->rescanned, s->allocs,
+      s->inclusive, s->exclusive);
+  }
+  
+  fprintf(f, "\n]}\n");
+  mpc_profile_lock(0);
+  free(rows);
+}
@@ -70,6 +70,20 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parsing never modifies a parser, so threads
+** can parse with the same parser at the same
+** time. Changing a parser only affects parsing
+** with the parsers that reach it.
+**
+** `mpc_parse_batch` parses the `n` strings on up
+** to `nthreads` threads, storing the result and
+** return value for `strings[j]` in `r[j]` and
+** `x[j]`. It returns the number which parsed.
+*/
+
+int mpc_parse_batch(const char *filename, const char **strings, int n, mpc_parser_t *p, mpc_result_t *r, int *x, int nthreads);
+
 /*
 ** Function Types
 */
@@ -81,6 +95,46 @@ typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 
+/*
+** Incremental Parsing
+**
+** Input is fed in chunks as it arrives. A
+** parse stops where it runs out of input and
+** carries on from there with the next chunk,
+** rather than starting over. Each feed
+** reports one of:
+**
+**   ERROR - the input is wrong, whatever follows
+**   DONE  - parsed, whatever follows
+**   MORE  - the input so far is incomplete
+**   READY - the input so far parses, but more
+**           might extend it; `mpc_parse_finish`
+**           takes the result as it is
+**
+** Results of ERROR and DONE are in `r`, as for
+** `mpc_parse`. `mpc_parse_finish` ends the input
+** and returns DONE or ERROR. A parse still going
+** when the context is deleted is finished, and
+** its result destroyed with `d`. The parsers `p`
+** reaches must not be changed while a parse is
+** going, as it keeps hold of their program.
+*/
+
+enum {
+  MPC_PARSE_ERROR = 0,
+  MPC_PARSE_DONE  = 1,
+  MPC_PARSE_MORE  = 2,
+  MPC_PARSE_READY = 3
+};
+
+struct mpc_parse_ctx_t;
+typedef struct mpc_parse_ctx_t mpc_parse_ctx_t;
+
+mpc_parse_ctx_t *mpc_parse_ctx_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d);
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c);
+int mpc_parse_feed(mpc_parse_ctx_t *c, const char *chunk, size_t length, mpc_result_t *r);
+int mpc_parse_finish(mpc_parse_ctx_t *c, mpc_result_t *r);
+
 /*
 ** Building a Parser
 */
@@ -140,6 +194,20 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Packrat Parsing
+**
+** `mpc_memo` remembers the result of `a` at
+** each position it is tried, so that after a
+** backtrack it is not run again there. Results
+** are handed out through `copy` and the ones
+** remembered are destroyed with `da`. A NULL
+** `copy` shares one result between all uses,
+** for values that are owned elsewhere.
+*/
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da);
+
 /*
 ** Common Parsers
 */
@@ -278,6 +346,7 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -321,6 +390,7 @@ mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
 
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
 
@@ -334,7 +404,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -344,6 +415,63 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Compiling
+**
+** A parser is compiled to a flat program when
+** it is defined. Redefining, optimising or
+** profiling a parser compiles again just the
+** programs that reach it. Parsers built but
+** never defined are compiled for each parse
+** unless kept compiled with `mpc_compile`.
+**
+** `mpc_optimise` compiles the parser as well,
+** and gives each `or` it reaches a table of the
+** alternatives worth trying at each byte. The
+** `or`s reaching a parser that is redefined go
+** without, until the grammar is optimised again.
+*/
+
+void mpc_compile(mpc_parser_t *p);
+
+/*
+** Profiling
+**
+** `mpc_profile` starts counting, for each parser
+** reachable from `p`, how often it is run, how
+** often it succeeds and fails, the bytes it
+** consumes, the bytes it rewinds over to be read
+** again, the allocations it makes itself and the
+** time spent in it, in total and outside the
+** parsers it runs. Calling it again zeroes the
+** counts and `mpc_profile_stop` stops counting.
+** Optimising a parser drops its counts, so
+** profile after `mpc_optimise`.
+**
+** `mpc_profile_print` writes the counts as a
+** table and `mpc_profile_print_json` as JSON,
+** for the parsers that have run, most time
+** spent in itself first.
+**
+** Each parse counts on its own and adds its
+** counts in when it is done, so profiled parsers
+** can be shared between threads. Starting and
+** stopping compile again every program using a
+** parser reachable from `p`, so must not happen
+** while any of those is being parsed.
+**
+** Some parsers are run as one, and are listed
+** as one: an `expect` around a character, set,
+** range or string counts as the `expect`, and
+** a `many` or `many1` of single characters from
+** a set counts as the repeat.
+*/
+
+void mpc_profile(mpc_parser_t *p);
+void mpc_profile_stop(mpc_parser_t *p);
+void mpc_profile_print(mpc_parser_t *p, FILE *f);
+void mpc_profile_print_json(mpc_parser_t *p, FILE *f);
+
 /*
 ** Misc
 */
@@ -1,148 +1,657 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifndef LISPY_NO_MAIN
 #include <editline/readline.h>
+#endif
 #include "mpc.h"
 
 /* Typedefs
  * -------------------------------------------------------------------------- */
+// Region allocator. Memory is carved out of a chain of blocks and is only
+// ever given back all at once, by arena_reset().
+typedef struct arena_block {
+        struct arena_block *next;
+        size_t size;
+        size_t used;
+        char data[];
+} arena_block_t;
+
+typedef struct arena {
+        arena_block_t *first;
+        arena_block_t *cur; // Block allocations are currently taken from;
+} arena_t;
+
+enum { ARENA_BLOCK_SIZE = 64 * 1024, ARENA_ALIGN = 8 };
+
+// An lval_t pointer with its lowest bit set is not a pointer at all but an
+// immediate integer (a fixnum) held in the remaining bits. Only numbers
+// that do not fit in a fixnum, symbols, errors and sexprs are allocated.
+// Always go through lval_type() to inspect a value.
+//
+// A number that is not a fixnum is a bignum: a sign and a magnitude of
+// cnt 32-bit limbs, least significant first and with no leading zeros.
+//
+// Sexprs are allocated with room for LVAL_SMALL_CELLS children inside the
+// node itself. Past that, cell moves to a separate array that doubles in
+// capacity whenever it fills up.
 typedef struct lval {
         int type;
-        long num;
+        int cnt; // Number of elements in cell list, or of limbs in limb;
+        int cap; // Number of elements cell has room for;
+        int atom; // Interned name of a symbol, see symtab_intern();
+        bool neg; // Sign of a bignum;
+        uint32_t *limb; // Magnitude of a bignum;
         char *err;
-        char *sym;
-        int cnt; // Number of elements in cell list;
         struct lval **cell;
+        struct lval *small[]; // Inline cells, sexprs only;
 } lval_t;
 
+enum { LVAL_SMALL_CELLS = 4 };
+
 // Possible lval_t types.
 enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPR };
 
+// Interned symbol names. Every distinct symbol is stored once and is
+// identified by its atom, the index of its name in names. Readers intern
+// from several threads at once, so symtab_intern() holds lock throughout.
+typedef struct symtab {
+        char **names;
+        uint32_t *hashes;
+        int cnt; // Number of atoms;
+        int cap;
+        int *slots; // Open addressed table of atoms, -1 if empty;
+        int slots_cap; // Always a power of two;
+        pthread_mutex_t lock;
+} symtab_t;
+
+// Parsers of the reader, which builds lval_t values into an arena straight
+// from the input text, with no mpc_ast_t in between. The language is:
+//
+//   number : /-?[0-9]+/ ;
+//   symbol : '+' | '-' | '*' | '/' ;
+//   sexpr  : '(' <expr>* ')' ;
+//   expr   : <number> | <symbol> | <sexpr> ;
+//   lispy  : /^/ <expr>* /$/ ;
+typedef struct reader {
+        mpc_parser_t *number;
+        mpc_parser_t *symbol;
+        mpc_parser_t *sexpr;
+        mpc_parser_t *expr;
+        mpc_parser_t *lispy;
+} reader_t;
+
+// Children of an sexpr as collected by the reader, before they are moved
+// into the arena.
+typedef struct cells {
+        int cnt;
+        lval_t *cell[];
+} cells_t;
+
+// Atoms of the builtin operators, interned first by symtab_init() so that
+// they index builtin_opcodes directly.
+enum { ATOM_ADD, ATOM_SUB, ATOM_MUL, ATOM_DIV, ATOM_BUILTIN_CNT };
+
+#define LVAL_FIXNUM_TAG ((uintptr_t)1)
+#define LVAL_FIXNUM_MAX (INTPTR_MAX >> 1)
+#define LVAL_FIXNUM_MIN (INTPTR_MIN >> 1)
+
+// A number as sign and magnitude, see big_view().
+typedef struct big {
+        bool neg;
+        int cnt;
+        uint32_t *limb;
+        uint32_t fix[(sizeof(long) + 3) / 4]; // Limbs of a fixnum;
+} big_t;
+
+// Operands with fewer limbs than this are multiplied the schoolbook way.
+enum { KARATSUBA_CUTOFF = 32 };
+
 // Possible lval_t errors.
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+// Bytecode produced by lval_compile() and run by vm_run(). Code is a flat
+// array of words: an opcode followed by its immediate operand, if any.
+typedef struct chunk {
+        long *code;
+        int cnt; // Number of words in code;
+        int cap;
+        int depth; // Maximum value stack depth needed by the code;
+        lval_t **konst; // Constant results referenced by OP_CONST. They
+                        // live in the arena the chunk was compiled with;
+        int konst_cnt;
+        lval_t **stack; // Value stack, sized to depth;
+} chunk_t;
+
+// Possible bytecode opcodes.
+enum {
+        OP_PUSH,  // OP_PUSH <num>: push an immediate fixnum.
+        OP_LOAD,  // OP_LOAD <k>: push constant k, a bignum.
+        OP_ADD,   // OP_ADD <argc>: fold argc stack values with '+'.
+        OP_SUB,   // OP_SUB <argc>: ditto with '-'.
+        OP_MUL,   // OP_MUL <argc>: ditto with '*'.
+        OP_DIV,   // OP_DIV <argc>: ditto with '/'.
+        OP_CONST, // OP_CONST <k>: stop, the result is constant k.
+        OP_RET    // OP_RET: stop, the result is the number on the stack.
+};
+
+// What a compiled subexpression leaves behind at run time.
+enum {
+        KIND_NUM,   // A number on the value stack.
+        KIND_CONST, // Nothing; its value is known at compile time.
+        KIND_RAISED // Nothing; an OP_CONST error was emitted, code stops there.
+};
+
+// An S-expression being walked by the printer or the compiler, which keep
+// these on an explicit stack instead of recursing.
+typedef struct frame {
+        lval_t *v;
+        int i; // Index of the cell being worked on;
+        int depth; // Compiler: stack depth before the call's operands;
+        lval_t *op; // Compiler: the operator, if the head is constant;
+        int argc; // Compiler: number of operands on the stack;
+        bool args_are_nums;
+} frame_t;
+
+typedef struct frames {
+        frame_t *frame;
+        int cnt;
+        int cap;
+} frames_t;
+
+// Top-level forms streamed from a file a batch at a time by source_split().
+// Only the batch being read is kept in buf, so memory use is bounded by the
+// batch size or the largest form rather than by the size of the input.
+typedef struct source {
+        const char *name;
+        FILE *file;
+        char *buf;
+        size_t start; // Offset of the first unconsumed byte;
+        size_t len; // Number of bytes in buf;
+        size_t cap;
+        bool eof;
+        long pos; // Input position of buf[start];
+        long row;
+        long col;
+} source_t;
+
+enum {
+        SOURCE_BLOCK_SIZE = 64 * 1024,
+        SOURCE_BATCH_SIZE = 1024 * 1024 // Bytes read ahead per reader thread;
+};
+
+// A top-level form found by source_split(), and what reading it gave.
+typedef struct form {
+        size_t off; // Offset of the form in the source buffer;
+        size_t len;
+        bool ok; // Whether res holds a value rather than an error;
+        mpc_result_t res;
+} form_t;
+
+// Readers that the forms of a batch are spread over, one per thread. The
+// reader callbacks allocate from the arena their reader was created with,
+// so each reader has an arena of its own.
+typedef struct pool {
+        int cnt;
+        reader_t **readers;
+        arena_t **arenas;
+} pool_t;
+
+// A run of consecutive forms of a batch, read by one thread.
+typedef struct job {
+        pthread_t thread;
+        bool started;
+        reader_t *reader;
+        const char *name;
+        const char *buf;
+        form_t *form;
+        int cnt;
+} job_t;
+
+/* Globals
+ * -------------------------------------------------------------------------- */
+static symtab_t symtab;
+
 /* Private routine prototypes
  * -------------------------------------------------------------------------- */
-static lval_t* lval_new_num(long x);
-static lval_t* lval_new_err(char *msg);
-static lval_t* lval_new_sym(char *sym);
-static lval_t* lval_new_sexpr(void);
-static void sexpr_del(lval_t *sexpr);
-static void lval_del(lval_t *v);
-static void lval_print_expr(lval_t *v, char open, char close);
+static arena_t* arena_new(void);
+static void arena_del(arena_t *a);
+static void arena_reset(arena_t *a);
+static void* arena_alloc(arena_t *a, size_t n);
+static char* arena_strdup(arena_t *a, const char *s);
+static uint32_t symtab_hash(const char *s, size_t n);
+static void symtab_init(void);
+static void symtab_del(void);
+static int symtab_intern(const char *s, size_t n);
+static const char* symtab_name(int atom);
+static inline bool lval_is_fixnum(lval_t *v);
+static inline int lval_type(lval_t *v);
+static inline long lval_fixnum(lval_t *v);
+static inline lval_t* lval_new_fixnum(long x);
+static lval_t* lval_new_num(arena_t *a, long x);
+static lval_t* lval_new_err(arena_t *a, char *msg);
+static lval_t* lval_new_sym(arena_t *a, const char *sym);
+static lval_t* lval_new_sexpr(arena_t *a);
+static void sexpr_reserve(arena_t *a, lval_t *v, int n);
+static uint32_t mag_add_to(uint32_t *r, int n, const uint32_t *x, int xn);
+static uint32_t mag_sub_from(uint32_t *r, int n, const uint32_t *x, int xn);
+static int mag_cmp(const uint32_t *x, int xn, const uint32_t *y, int yn);
+static void mag_mul_school(uint32_t *r, const uint32_t *x, int xn,
+                           const uint32_t *y, int yn);
+static void mag_mul(arena_t *a, uint32_t *r, const uint32_t *x, int xn,
+                    const uint32_t *y, int yn);
+static uint32_t mag_div_small(uint32_t *q, const uint32_t *x, int xn,
+                              uint32_t d);
+static void mag_div(arena_t *a, uint32_t *q, const uint32_t *x, int xn,
+                    const uint32_t *y, int yn);
+static void big_view(lval_t *v, big_t *b);
+static lval_t* big_make(arena_t *a, bool neg, uint32_t *limb, int cnt);
+static lval_t* big_add(arena_t *a, lval_t *x, lval_t *y, bool sub);
+static lval_t* big_mul(arena_t *a, lval_t *x, lval_t *y);
+static lval_t* big_div(arena_t *a, lval_t *x, lval_t *y);
+static lval_t* big_read(arena_t *a, const char *s);
+static void big_print(lval_t *v);
+static inline lval_t* num_add(arena_t *a, lval_t *x, lval_t *y);
+static inline lval_t* num_sub(arena_t *a, lval_t *x, lval_t *y);
+static inline lval_t* num_mul(arena_t *a, lval_t *x, lval_t *y);
+static inline lval_t* num_div(arena_t *a, lval_t *x, lval_t *y);
+static frame_t* frames_push(frames_t *s, lval_t *v);
 static void lval_print(lval_t *v);
 static void lval_println(lval_t *v);
-static bool is_number_leaf(mpc_ast_t *tree);
-static bool is_expression_node(mpc_ast_t *tree);
-static lval_t* eval_op(lval_t *x, char *op, lval_t *y);
-static lval_t* lval_read_num(mpc_ast_t *tree);
-static lval_t* lval_add_to_sexpr(lval_t *dst_node, lval_t *src_node);
-static lval_t* eval (mpc_ast_t *tree);
+static mpc_val_t* lval_read_num(mpc_val_t *x, void *a);
+static mpc_val_t* lval_read_sym(mpc_val_t *x, void *a);
+static mpc_val_t* lval_read_sexpr(mpc_val_t *x, void *a);
+static mpc_val_t* lval_fold_cells(int n, mpc_val_t **xs);
+static reader_t* reader_new(arena_t *a);
+static void reader_del(reader_t *r);
+static chunk_t* chunk_new(void);
+static void chunk_del(chunk_t *c);
+static void chunk_emit(chunk_t *c, long word);
+static int chunk_add_konst(chunk_t *c, lval_t *v);
+static int builtin_opcode(int atom);
+static int compile_raise(arena_t *a, chunk_t *c, char *msg);
+static int compile_leaf(chunk_t *c, lval_t *v, int depth, lval_t **konst);
+static int compile_apply(arena_t *a, chunk_t *c, frame_t *f);
+static int compile_expr(arena_t *a, chunk_t *c, lval_t *v, lval_t **konst);
+static chunk_t* lval_compile(arena_t *a, lval_t *v);
+static lval_t* vm_run(arena_t *a, chunk_t *c);
+static lval_t* lval_eval(arena_t *a, lval_t *v);
+#ifndef LISPY_NO_MAIN
+static bool source_fill(source_t *s);
+static void source_consume(source_t *s, size_t n);
+static size_t form_end(const char *buf, size_t i, size_t len);
+static int source_split(source_t *s, form_t **forms, int *cap);
+static pool_t* pool_new(int cnt);
+static void pool_del(pool_t *p);
+static void* job_run(void *arg);
+static void pool_read(pool_t *p, const char *name, const char *buf,
+                      form_t *forms, int cnt);
+static int run_file(pool_t *p, arena_t *a, const char *name);
+static void run_repl(reader_t *r, arena_t *a);
+#endif
+
+/* Arena allocator
+ * -------------------------------------------------------------------------- */
+static arena_block_t*
+arena_block_new(size_t size)
+{
+        arena_block_t *b = malloc(sizeof(arena_block_t) + size);
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+        return b;
+}
+
+static arena_t*
+arena_new(void)
+{
+        arena_t *a = malloc(sizeof(arena_t));
+        a->first = arena_block_new(ARENA_BLOCK_SIZE);
+        a->cur = a->first;
+        return a;
+}
+
+static void
+arena_del(arena_t *a)
+{
+        arena_block_t *b = a->first;
+
+        while (b) {
+                arena_block_t *next = b->next;
+                free(b);
+                b = next;
+        }
+        free(a);
+}
+
+// Releases everything allocated from the arena. The blocks are kept and
+// reused by later allocations.
+static void
+arena_reset(arena_t *a)
+{
+        for (arena_block_t *b = a->first; b; b = b->next) {
+                b->used = 0;
+        }
+        a->cur = a->first;
+}
+
+static void*
+arena_alloc(arena_t *a, size_t n)
+{
+        n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+        while (a->cur->used + n > a->cur->size) {
+                arena_block_t *next = a->cur->next;
+
+                if (next == NULL || next->size < n) {
+                        size_t size = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+                        arena_block_t *b = arena_block_new(size);
+                        b->next = next;
+                        a->cur->next = b;
+                        next = b;
+                }
+                a->cur = next;
+        }
+
+        void *p = a->cur->data + a->cur->used;
+        a->cur->used += n;
+        return p;
+}
+
+static char*
+arena_strdup(arena_t *a, const char *s)
+{
+        size_t n = strlen(s) + 1;
+        char *d = arena_alloc(a, n);
+        memcpy(d, s, n);
+        return d;
+}
+
+/* Symbol table
+ * -------------------------------------------------------------------------- */
+static uint32_t
+symtab_hash(const char *s, size_t n)
+{
+        // FNV-1a.
+        uint32_t h = 2166136261u;
+
+        for (size_t i = 0; i < n; i++) {
+                h ^= (unsigned char)s[i];
+                h *= 16777619u;
+        }
+        return h;
+}
+
+static void
+symtab_init(void)
+{
+        static const char *builtins[ATOM_BUILTIN_CNT] = { "+", "-", "*", "/" };
+
+        symtab.names = NULL;
+        symtab.hashes = NULL;
+        symtab.cnt = 0;
+        symtab.cap = 0;
+        symtab.slots_cap = 64;
+        symtab.slots = malloc(sizeof(int) * symtab.slots_cap);
+        memset(symtab.slots, -1, sizeof(int) * symtab.slots_cap);
+        pthread_mutex_init(&symtab.lock, NULL);
+
+        for (int i = 0; i < ATOM_BUILTIN_CNT; i++) {
+                symtab_intern(builtins[i], strlen(builtins[i]));
+        }
+}
+
+static void
+symtab_del(void)
+{
+        for (int i = 0; i < symtab.cnt; i++) {
+                free(symtab.names[i]);
+        }
+        free(symtab.names);
+        free(symtab.hashes);
+        free(symtab.slots);
+        pthread_mutex_destroy(&symtab.lock);
+}
+
+static void
+symtab_grow(void)
+{
+        symtab.slots_cap *= 2;
+        symtab.slots = realloc(symtab.slots, sizeof(int) * symtab.slots_cap);
+        memset(symtab.slots, -1, sizeof(int) * symtab.slots_cap);
+
+        uint32_t mask = symtab.slots_cap - 1;
+        for (int atom = 0; atom < symtab.cnt; atom++) {
+                uint32_t i = symtab.hashes[atom] & mask;
+                while (symtab.slots[i] != -1) {
+                        i = (i + 1) & mask;
+                }
+                symtab.slots[i] = atom;
+        }
+}
+
+// Returns the atom of the n characters at s, adding it to the table the
+// first time it is seen. Safe to call from several threads.
+static int
+symtab_intern(const char *s, size_t n)
+{
+        uint32_t h = symtab_hash(s, n);
+
+        pthread_mutex_lock(&symtab.lock);
+
+        uint32_t mask = symtab.slots_cap - 1;
+        uint32_t i = h & mask;
+
+        while (symtab.slots[i] != -1) {
+                int atom = symtab.slots[i];
+                char *name = symtab.names[atom];
+
+                if (symtab.hashes[atom] == h &&
+                    strncmp(name, s, n) == 0 && name[n] == '\0') {
+                        pthread_mutex_unlock(&symtab.lock);
+                        return atom;
+                }
+                i = (i + 1) & mask;
+        }
+
+        if (symtab.cnt == symtab.cap) {
+                symtab.cap = symtab.cap ? symtab.cap * 2 : 64;
+                symtab.names = realloc(symtab.names, sizeof(char*) * symtab.cap);
+                symtab.hashes = realloc(symtab.hashes, sizeof(uint32_t) * symtab.cap);
+        }
+
+        int atom = symtab.cnt++;
+        symtab.names[atom] = malloc(n + 1);
+        memcpy(symtab.names[atom], s, n);
+        symtab.names[atom][n] = '\0';
+        symtab.hashes[atom] = h;
+        symtab.slots[i] = atom;
+
+        // Keep the load factor at or below one half.
+        if (symtab.cnt * 2 > symtab.slots_cap) {
+                symtab_grow();
+        }
+
+        pthread_mutex_unlock(&symtab.lock);
+        return atom;
+}
+
+static const char*
+symtab_name(int atom)
+{
+        return symtab.names[atom];
+}
 
 /* Private routines
  * -------------------------------------------------------------------------- */
+static inline bool
+lval_is_fixnum(lval_t *v)
+{
+        return ((uintptr_t)v & LVAL_FIXNUM_TAG) != 0;
+}
+
+static inline int
+lval_type(lval_t *v)
+{
+        return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long
+lval_fixnum(lval_t *v)
+{
+        return (long)((intptr_t)v >> 1);
+}
+
+// x must be within [LVAL_FIXNUM_MIN, LVAL_FIXNUM_MAX].
+static inline lval_t*
+lval_new_fixnum(long x)
+{
+        return (lval_t*)(((uintptr_t)(intptr_t)x << 1) | LVAL_FIXNUM_TAG);
+}
+
 static lval_t*
-lval_new_num(long x)
+lval_new_num(arena_t *a, long x)
 {
-        lval_t *v = malloc(sizeof(lval_t));
-        v->type = LVAL_NUM;
-        v->num = x;
-        return v;
+        if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+                return lval_new_fixnum(x);
+        }
+
+        big_t b;
+        b.cnt = 0;
+        unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+        while (m != 0) {
+                b.fix[b.cnt++] = (uint32_t)m;
+                m >>= 16;
+                m >>= 16;
+        }
+
+        uint32_t *limb = arena_alloc(a, sizeof(uint32_t) * b.cnt);
+        memcpy(limb, b.fix, sizeof(uint32_t) * b.cnt);
+        return big_make(a, x < 0, limb, b.cnt);
 }
 
 static lval_t*
-lval_new_err(char *msg)
+lval_new_err(arena_t *a, char *msg)
 {
-        lval_t *v = malloc(sizeof(lval_t));
+        lval_t *v = arena_alloc(a, sizeof(lval_t));
         v->type = LVAL_ERR;
-        v->err = malloc(strlen(msg) + 1);
-        strcpy(v->err, msg);
+        v->err = arena_strdup(a, msg);
         return v;
 }
 
 static lval_t*
-lval_new_sym(char *sym)
+lval_new_sym(arena_t *a, const char *sym)
 {
-        lval_t *v = malloc(sizeof(lval_t));
+        lval_t *v = arena_alloc(a, sizeof(lval_t));
         v->type = LVAL_SYM;
-        v->sym = malloc(strlen(sym) + 1);
-        strcpy(v->sym, sym);
+        v->atom = symtab_intern(sym, strlen(sym));
         return v;
 }
 
 static lval_t*
-lval_new_sexpr(void)
+lval_new_sexpr(arena_t *a)
 {
-        lval_t *v = malloc(sizeof(lval_t));
+        lval_t *v = arena_alloc(a, sizeof(lval_t) +
+                                   sizeof(lval_t*) * LVAL_SMALL_CELLS);
         v->type = LVAL_SEXPR;
         v->cnt = 0;
-        v->cell = NULL;
+        v->cap = LVAL_SMALL_CELLS;
+        v->cell = v->small;
         return v;
 }
 
+// Makes room for at least n cells in sexpr v.
 static void
-sexpr_del(lval_t *sexpr)
+sexpr_reserve(arena_t *a, lval_t *v, int n)
 {
-        for (int i = 0; i < sexpr->cnt; i++) {
-                lval_del(sexpr->cell[i]);
+        if (n <= v->cap) {
+                return;
         }
-        free(sexpr->cell);
+
+        int cap = v->cap * 2 > n ? v->cap * 2 : n;
+        lval_t **cell = arena_alloc(a, sizeof(lval_t*) * cap);
+        memcpy(cell, v->cell, sizeof(lval_t*) * v->cnt);
+        v->cell = cell;
+        v->cap = cap;
 }
 
-static void
-lval_del(lval_t *v)
+static frame_t*
+frames_push(frames_t *s, lval_t *v)
 {
-        switch (v->type) {
-        case LVAL_NUM:
-                break;
-        case LVAL_ERR:
-                free(v->err);
-                break;
-        case LVAL_SYM:
-                free(v->sym);
-                break;
-        case LVAL_SEXPR:
-                sexpr_del(v);
-                break;
+        if (s->cnt == s->cap) {
+                s->cap = s->cap ? s->cap * 2 : 32;
+                s->frame = realloc(s->frame, sizeof(frame_t) * s->cap);
         }
 
-        free(v);
+        frame_t *f = &s->frame[s->cnt++];
+        f->v = v;
+        f->i = 0;
+        f->depth = 0;
+        f->op = NULL;
+        f->argc = 0;
+        f->args_are_nums = true;
+        return f;
 }
 
 static void
-lval_print_expr(lval_t *v, char open, char close)
+lval_print(lval_t *v)
 {
-        putchar(open);
+        frames_t frames = { NULL, 0, 0 };
 
-        for (int i = 0; i < v->cnt; i++) {
-                lval_print(v->cell[i]);
+        for (;;) {
+                switch (lval_type(v)) {
+                case LVAL_NUM:
+                        if (lval_is_fixnum(v)) {
+                                printf("%li", lval_fixnum(v));
+                        } else {
+                                big_print(v);
+                        }
+                        break;
+                case LVAL_ERR:
+                        printf("Error: %s", v->err);
+                        break;
+                case LVAL_SYM:
+                        printf("%s", symtab_name(v->atom));
+                        break;
+                case LVAL_SEXPR:
+                        putchar('(');
+                        frames_push(&frames, v);
+                        break;
+                default:
+                        break;
+                }
 
-                if (i != (v->cnt - 1)) {
+                // Close the S-expressions printed in full, then go on with
+                // the next cell of the innermost one still open.
+                while (frames.cnt > 0) {
+                        frame_t *f = &frames.frame[frames.cnt - 1];
+                        if (f->i < f->v->cnt) {
+                                break;
+                        }
+                        putchar(')');
+                        frames.cnt--;
+                }
+
+                if (frames.cnt == 0) {
+                        break;
+                }
+
+                frame_t *f = &frames.frame[frames.cnt - 1];
+                if (f->i > 0) {
                         putchar(' ');
                 }
+                v = f->v->cell[f->i++];
         }
-        putchar(close);
-}
 
-static void
-lval_print(lval_t *v)
-{
-        switch (v->type) {
-        case LVAL_NUM:
-                printf("%li", v->num);
-                break;
-        case LVAL_ERR:
-                printf("Error: %s", v->err);
-                break;
-        case LVAL_SYM:
-                printf("%s", v->sym);
-                break;
-        case LVAL_SEXPR:
-                lval_print_expr(v, '(', ')');
-                break;
-        default:
-                break;
-        }
+        free(frames.frame);
 }
 
 static void
@@ -153,185 +662,1232 @@ lval_println(lval_t *v)
         putchar('\n');
 }
 
-static bool
-is_number_leaf(mpc_ast_t *tree)
+/* Numbers
+ * -------------------------------------------------------------------------- */
+// Fixnum arithmetic is done on the tagged words themselves, so that the
+// common case is one machine instruction plus an overflow check. Anything
+// that overflows, or involves a bignum, goes through the big_*() routines,
+// which work on magnitudes as arrays of 32-bit limbs, least significant
+// first, allocated from the arena.
+static uint32_t
+mag_add_to(uint32_t *r, int n, const uint32_t *x, int xn)
 {
-        if (strstr(tree->tag, "number")) {
-                return true;
-        } else {
-                return false;
+        uint64_t carry = 0;
+        int i;
+
+        for (i = 0; i < xn; i++) {
+                carry += (uint64_t)r[i] + x[i];
+                r[i] = (uint32_t)carry;
+                carry >>= 32;
+        }
+        for (; carry != 0 && i < n; i++) {
+                carry += r[i];
+                r[i] = (uint32_t)carry;
+                carry >>= 32;
         }
+
+        return (uint32_t)carry;
 }
 
-static bool
-is_node_of_type(mpc_ast_t *node, char *type)
+static uint32_t
+mag_sub_from(uint32_t *r, int n, const uint32_t *x, int xn)
 {
-        return strstr(node->tag, type) != 0 ? true : false;
+        uint32_t borrow = 0;
+        int i;
+
+        for (i = 0; i < xn; i++) {
+                uint64_t d = (uint64_t)r[i] - x[i] - borrow;
+                r[i] = (uint32_t)d;
+                borrow = (d >> 32) != 0;
+        }
+        for (; borrow != 0 && i < n; i++) {
+                borrow = r[i] == 0;
+                r[i]--;
+        }
+
+        return borrow;
 }
 
-static bool
-is_node_root(mpc_ast_t *node)
+static int
+mag_cmp(const uint32_t *x, int xn, const uint32_t *y, int yn)
 {
-        return strcmp(node->tag, ">") == 0 ? true : false;
+        if (xn != yn) {
+                return xn < yn ? -1 : 1;
+        }
+
+        for (int i = xn - 1; i >= 0; i--) {
+                if (x[i] != y[i]) {
+                        return x[i] < y[i] ? -1 : 1;
+                }
+        }
+
+        return 0;
 }
 
-static bool
-is_expression_node(mpc_ast_t *node)
+static void
+mag_mul_school(uint32_t *r, const uint32_t *x, int xn,
+               const uint32_t *y, int yn)
+{
+        memset(r, 0, sizeof(uint32_t) * (xn + yn));
+
+        for (int i = 0; i < yn; i++) {
+                uint64_t carry = 0;
+                for (int j = 0; j < xn; j++) {
+                        carry += (uint64_t)x[j] * y[i] + r[i + j];
+                        r[i + j] = (uint32_t)carry;
+                        carry >>= 32;
+                }
+                r[i + xn] = (uint32_t)carry;
+        }
+}
+
+// Sets r[0, xn + yn) to x * y. Operands may have leading zero limbs.
+// Temporaries come from the arena.
+static void
+mag_mul(arena_t *a, uint32_t *r, const uint32_t *x, int xn,
+        const uint32_t *y, int yn)
+{
+        if (xn < yn) {
+                const uint32_t *t = x;
+                x = y;
+                y = t;
+                int tn = xn;
+                xn = yn;
+                yn = tn;
+        }
+
+        if (yn < KARATSUBA_CUTOFF) {
+                mag_mul_school(r, x, xn, y, yn);
+                return;
+        }
+
+        // Lopsided operands: multiply y by each yn limb slice of x.
+        if (xn >= 2 * yn) {
+                uint32_t *t = arena_alloc(a, sizeof(uint32_t) * 2 * yn);
+                memset(r, 0, sizeof(uint32_t) * (xn + yn));
+                for (int i = 0; i < xn; i += yn) {
+                        int n = xn - i < yn ? xn - i : yn;
+                        mag_mul(a, t, x + i, n, y, yn);
+                        mag_add_to(r + i, xn + yn - i, t, n + yn);
+                }
+                return;
+        }
+
+        // Karatsuba: with x = x1 B^m + x0 and y = y1 B^m + y0,
+        // x * y = z2 B^2m + z1 B^m + z0, where z0 = x0 y0, z2 = x1 y1 and
+        // z1 = (x0 + x1)(y0 + y1) - z0 - z2.
+        int m = xn / 2;
+        int sxn = xn - m + 1;
+        int syn = (yn - m > m ? yn - m : m) + 1;
+        uint32_t *sx = arena_alloc(a, sizeof(uint32_t) * sxn);
+        uint32_t *sy = arena_alloc(a, sizeof(uint32_t) * syn);
+        uint32_t *z1 = arena_alloc(a, sizeof(uint32_t) * (sxn + syn));
+
+        memset(sx, 0, sizeof(uint32_t) * sxn);
+        memcpy(sx, x + m, sizeof(uint32_t) * (xn - m));
+        mag_add_to(sx, sxn, x, m);
+
+        memset(sy, 0, sizeof(uint32_t) * syn);
+        memcpy(sy, y, sizeof(uint32_t) * m);
+        mag_add_to(sy, syn, y + m, yn - m);
+
+        mag_mul(a, r, x, m, y, m);
+        mag_mul(a, r + 2 * m, x + m, xn - m, y + m, yn - m);
+        mag_mul(a, z1, sx, sxn, sy, syn);
+
+        mag_sub_from(z1, sxn + syn, r, 2 * m);
+        mag_sub_from(z1, sxn + syn, r + 2 * m, xn + yn - 2 * m);
+
+        // z1 < B^(xn + yn - m), so any limbs past that are zero.
+        int zn = sxn + syn < xn + yn - m ? sxn + syn : xn + yn - m;
+        mag_add_to(r + m, xn + yn - m, z1, zn);
+}
+
+// Sets q[0, xn) to x / d and returns the remainder. q may be x.
+static uint32_t
+mag_div_small(uint32_t *q, const uint32_t *x, int xn, uint32_t d)
+{
+        uint64_t rem = 0;
+
+        for (int i = xn - 1; i >= 0; i--) {
+                rem = (rem << 32) | x[i];
+                q[i] = (uint32_t)(rem / d);
+                rem %= d;
+        }
+
+        return (uint32_t)rem;
+}
+
+// Sets q[0, xn - yn] to x / y, by Knuth's algorithm D. Requires
+// xn >= yn >= 2 and a nonzero leading limb in y.
+static void
+mag_div(arena_t *a, uint32_t *q, const uint32_t *x, int xn,
+        const uint32_t *y, int yn)
 {
-        if (strstr(node->tag, "expr")) {
-                return true;
+        const uint64_t base = (uint64_t)1 << 32;
+        uint32_t *un = arena_alloc(a, sizeof(uint32_t) * (xn + 1));
+        uint32_t *vn = arena_alloc(a, sizeof(uint32_t) * yn);
+
+        // Normalize, so that the leading limb of the divisor has its top
+        // bit set and each quotient digit estimate is off by at most two.
+        int s = __builtin_clz(y[yn - 1]);
+        for (int i = yn - 1; i > 0; i--) {
+                vn[i] = (y[i] << s) | (s ? y[i - 1] >> (32 - s) : 0);
+        }
+        vn[0] = y[0] << s;
+
+        un[xn] = s ? x[xn - 1] >> (32 - s) : 0;
+        for (int i = xn - 1; i > 0; i--) {
+                un[i] = (x[i] << s) | (s ? x[i - 1] >> (32 - s) : 0);
+        }
+        un[0] = x[0] << s;
+
+        for (int j = xn - yn; j >= 0; j--) {
+                uint64_t num = ((uint64_t)un[j + yn] << 32) | un[j + yn - 1];
+                uint64_t qhat = num / vn[yn - 1];
+                uint64_t rhat = num % vn[yn - 1];
+
+                while (qhat >= base ||
+                       qhat * vn[yn - 2] > ((rhat << 32) | un[j + yn - 2])) {
+                        qhat--;
+                        rhat += vn[yn - 1];
+                        if (rhat >= base) {
+                                break;
+                        }
+                }
+
+                // Multiply and subtract.
+                int64_t borrow = 0;
+                int64_t t;
+                for (int i = 0; i < yn; i++) {
+                        uint64_t p = qhat * vn[i];
+                        t = un[i + j] - borrow - (int64_t)(p & 0xffffffff);
+                        un[i + j] = (uint32_t)t;
+                        borrow = (int64_t)(p >> 32) - (t >> 32);
+                }
+                t = un[j + yn] - borrow;
+                un[j + yn] = (uint32_t)t;
+
+                // The estimate was one too large: add the divisor back.
+                q[j] = (uint32_t)qhat;
+                if (t < 0) {
+                        q[j]--;
+                        un[j + yn] += mag_add_to(un + j, yn, vn, yn);
+                }
+        }
+}
+
+// Views the number v as sign and magnitude, using b->fix as storage for
+// the limbs of a fixnum.
+static void
+big_view(lval_t *v, big_t *b)
+{
+        if (!lval_is_fixnum(v)) {
+                b->neg = v->neg;
+                b->cnt = v->cnt;
+                b->limb = v->limb;
+                return;
+        }
+
+        long x = lval_fixnum(v);
+        unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+
+        b->neg = x < 0;
+        b->cnt = 0;
+        b->limb = b->fix;
+        while (m != 0) {
+                b->fix[b->cnt++] = (uint32_t)m;
+                m >>= 16;
+                m >>= 16;
+        }
+}
+
+// Returns the number with the given sign and magnitude, which must have
+// been allocated from a and is taken over. Numbers always come out in
+// their canonical form: a fixnum whenever they fit in one.
+static lval_t*
+big_make(arena_t *a, bool neg, uint32_t *limb, int cnt)
+{
+        while (cnt > 0 && limb[cnt - 1] == 0) {
+                cnt--;
+        }
+
+        if (cnt <= 2) {
+                uint64_t m = cnt > 0 ? limb[0] : 0;
+                if (cnt > 1) {
+                        m |= (uint64_t)limb[1] << 32;
+                }
+                if (m <= (uint64_t)LVAL_FIXNUM_MAX) {
+                        return lval_new_fixnum(neg ? -(long)m : (long)m);
+                }
+                if (neg && m == (uint64_t)LVAL_FIXNUM_MAX + 1) {
+                        return lval_new_fixnum(LVAL_FIXNUM_MIN);
+                }
+        }
+
+        lval_t *v = arena_alloc(a, sizeof(lval_t));
+        v->type = LVAL_NUM;
+        v->neg = neg;
+        v->cnt = cnt;
+        v->limb = limb;
+        return v;
+}
+
+static lval_t*
+big_add(arena_t *a, lval_t *x, lval_t *y, bool sub)
+{
+        big_t bx, by;
+        big_view(x, &bx);
+        big_view(y, &by);
+        bool yneg = by.neg != sub;
+
+        if (bx.neg == yneg) {
+                big_t *l = bx.cnt >= by.cnt ? &bx : &by;
+                big_t *s = bx.cnt >= by.cnt ? &by : &bx;
+                uint32_t *r = arena_alloc(a, sizeof(uint32_t) * (l->cnt + 1));
+                memcpy(r, l->limb, sizeof(uint32_t) * l->cnt);
+                r[l->cnt] = 0;
+                mag_add_to(r, l->cnt + 1, s->limb, s->cnt);
+                return big_make(a, bx.neg, r, l->cnt + 1);
+        }
+
+        // Opposite signs: subtract the smaller magnitude from the larger.
+        bool x_larger = mag_cmp(bx.limb, bx.cnt, by.limb, by.cnt) >= 0;
+        big_t *l = x_larger ? &bx : &by;
+        big_t *s = x_larger ? &by : &bx;
+        uint32_t *r = arena_alloc(a, sizeof(uint32_t) * l->cnt);
+        memcpy(r, l->limb, sizeof(uint32_t) * l->cnt);
+        mag_sub_from(r, l->cnt, s->limb, s->cnt);
+        return big_make(a, x_larger ? bx.neg : yneg, r, l->cnt);
+}
+
+static lval_t*
+big_mul(arena_t *a, lval_t *x, lval_t *y)
+{
+        big_t bx, by;
+        big_view(x, &bx);
+        big_view(y, &by);
+
+        uint32_t *r = arena_alloc(a, sizeof(uint32_t) * (bx.cnt + by.cnt));
+        mag_mul(a, r, bx.limb, bx.cnt, by.limb, by.cnt);
+        return big_make(a, bx.neg != by.neg, r, bx.cnt + by.cnt);
+}
+
+// Truncating division, like C's. y must not be zero.
+static lval_t*
+big_div(arena_t *a, lval_t *x, lval_t *y)
+{
+        big_t bx, by;
+        big_view(x, &bx);
+        big_view(y, &by);
+
+        if (mag_cmp(bx.limb, bx.cnt, by.limb, by.cnt) < 0) {
+                return lval_new_fixnum(0);
+        }
+
+        int qn = bx.cnt - by.cnt + 1;
+        uint32_t *q = arena_alloc(a, sizeof(uint32_t) * (by.cnt == 1 ? bx.cnt : qn));
+        if (by.cnt == 1) {
+                qn = bx.cnt;
+                mag_div_small(q, bx.limb, bx.cnt, by.limb[0]);
         } else {
-                return false;
+                mag_div(a, q, bx.limb, bx.cnt, by.limb, by.cnt);
         }
+
+        return big_make(a, bx.neg != by.neg, q, qn);
 }
 
+// Reads a decimal integer too large for a long.
 static lval_t*
-lval_read_num(mpc_ast_t *tree)
+big_read(arena_t *a, const char *s)
+{
+        bool neg = *s == '-';
+        s += neg;
+
+        int digits = strlen(s);
+        uint32_t *limb = arena_alloc(a, sizeof(uint32_t) * (digits / 9 + 2));
+        int cnt = 0;
+
+        // Take in nine digits at a time, as 10^9 fits in a limb.
+        for (int n = digits % 9 ? digits % 9 : 9; *s != '\0'; n = 9) {
+                uint32_t chunk = 0;
+                uint32_t scale = 1;
+                for (int i = 0; i < n; i++) {
+                        chunk = chunk * 10 + (uint32_t)(*s++ - '0');
+                        scale *= 10;
+                }
+
+                uint64_t carry = chunk;
+                for (int i = 0; i < cnt; i++) {
+                        carry += (uint64_t)limb[i] * scale;
+                        limb[i] = (uint32_t)carry;
+                        carry >>= 32;
+                }
+                if (carry != 0) {
+                        limb[cnt++] = (uint32_t)carry;
+                }
+        }
+
+        return big_make(a, neg, limb, cnt);
+}
+
+static void
+big_print(lval_t *v)
+{
+        // Peel off nine decimal digits at a time, least significant first.
+        uint32_t *mag = malloc(sizeof(uint32_t) * v->cnt);
+        uint32_t *chunks = malloc(sizeof(uint32_t) * (v->cnt * 2 + 1));
+        int cnt = v->cnt;
+        int n = 0;
+
+        memcpy(mag, v->limb, sizeof(uint32_t) * cnt);
+        while (cnt > 0) {
+                chunks[n++] = mag_div_small(mag, mag, cnt, 1000000000);
+                while (cnt > 0 && mag[cnt - 1] == 0) {
+                        cnt--;
+                }
+        }
+
+        printf("%s%" PRIu32, v->neg ? "-" : "", chunks[n - 1]);
+        for (int i = n - 2; i >= 0; i--) {
+                printf("%09" PRIu32, chunks[i]);
+        }
+
+        free(chunks);
+        free(mag);
+}
+
+static inline lval_t*
+num_add(arena_t *a, lval_t *x, lval_t *y)
+{
+        // (2i + 1) + 2j = 2(i + j) + 1
+        intptr_t r;
+        if (lval_is_fixnum(x) && lval_is_fixnum(y) &&
+            !__builtin_add_overflow((intptr_t)x, (intptr_t)y - 1, &r)) {
+                return (lval_t*)r;
+        }
+
+        return big_add(a, x, y, false);
+}
+
+static inline lval_t*
+num_sub(arena_t *a, lval_t *x, lval_t *y)
+{
+        // (2i + 1) - 2j = 2(i - j) + 1
+        intptr_t r;
+        if (lval_is_fixnum(x) && lval_is_fixnum(y) &&
+            !__builtin_sub_overflow((intptr_t)x, (intptr_t)y - 1, &r)) {
+                return (lval_t*)r;
+        }
+
+        return big_add(a, x, y, true);
+}
+
+static inline lval_t*
+num_mul(arena_t *a, lval_t *x, lval_t *y)
+{
+        // i * 2j + 1 = 2ij + 1
+        intptr_t r;
+        if (lval_is_fixnum(x) && lval_is_fixnum(y) &&
+            !__builtin_mul_overflow((intptr_t)x >> 1, (intptr_t)y - 1, &r)) {
+                return (lval_t*)(r | LVAL_FIXNUM_TAG);
+        }
+
+        return big_mul(a, x, y);
+}
+
+// Returns NULL if y is zero.
+static inline lval_t*
+num_div(arena_t *a, lval_t *x, lval_t *y)
+{
+        if (y == lval_new_fixnum(0)) {
+                return NULL;
+        }
+
+        // Only LVAL_FIXNUM_MIN / -1 leaves the fixnum range.
+        if (lval_is_fixnum(x) && lval_is_fixnum(y)) {
+                return lval_new_num(a, lval_fixnum(x) / lval_fixnum(y));
+        }
+
+        return big_div(a, x, y);
+}
+
+/* Reader
+ * -------------------------------------------------------------------------- */
+// The reader callbacks below receive their input already exported from
+// mpc, so strings and cell lists are theirs to free.
+static mpc_val_t*
+lval_read_num(mpc_val_t *x, void *a)
 {
         errno = 0;
-        long x = strtol(tree->contents, NULL, 10);
+        long num = strtol(x, NULL, 10);
         lval_t *result =
-                errno != ERANGE ?
-                lval_new_num(x) : lval_new_err("invalid number");
+                errno != ERANGE ? lval_new_num(a, num) : big_read(a, x);
+        free(x);
         return result;
 }
 
-static lval_t*
-eval_op(lval_t *x, char *op, lval_t *y)
+static mpc_val_t*
+lval_read_sym(mpc_val_t *x, void *a)
+{
+        lval_t *result = lval_new_sym(a, x);
+        free(x);
+        return result;
+}
+
+static mpc_val_t*
+lval_fold_cells(int n, mpc_val_t **xs)
 {
-        if (x->type == LVAL_ERR) return x;
-        if (y->type == LVAL_ERR) return y;
+        cells_t *cells = malloc(sizeof(cells_t) + sizeof(lval_t*) * n);
+        cells->cnt = n;
+        memcpy(cells->cell, xs, sizeof(lval_t*) * n);
+        return cells;
+}
+
+static mpc_val_t*
+lval_read_sexpr(mpc_val_t *x, void *a)
+{
+        cells_t *cells = x;
+        lval_t *sexpr = lval_new_sexpr(a);
+
+        sexpr_reserve(a, sexpr, cells->cnt);
+        memcpy(sexpr->cell, cells->cell, sizeof(lval_t*) * cells->cnt);
+        sexpr->cnt = cells->cnt;
+
+        free(cells);
+        return sexpr;
+}
+
+// Creates the reader parsers. Everything they read is allocated from a,
+// so their results are released by resetting it.
+static reader_t*
+reader_new(arena_t *a)
+{
+        reader_t *r = malloc(sizeof(reader_t));
+        r->number = mpc_new("number");
+        r->symbol = mpc_new("symbol");
+        r->sexpr  = mpc_new("sexpr");
+        r->expr   = mpc_new("expr");
+        r->lispy  = mpc_new("lispy");
+
+        mpc_define(r->number, mpc_expect(
+                mpc_apply_to(mpc_tok(mpc_re("-?[0-9]+")), lval_read_num, a),
+                "number"));
+
+        mpc_define(r->symbol, mpc_expect(
+                mpc_apply_to(mpc_tok(mpc_oneof("+-*/")), lval_read_sym, a),
+                "symbol"));
+
+        mpc_define(r->sexpr, mpc_and(3, mpcf_snd_free,
+                mpc_sym("("),
+                mpc_apply_to(mpc_many(lval_fold_cells, r->expr),
+                             lval_read_sexpr, a),
+                mpc_sym(")"),
+                free, mpcf_dtor_null));
+
+        mpc_define(r->expr, mpc_or(3, r->number, r->symbol, r->sexpr));
+
+        mpc_define(r->lispy, mpc_total(
+                mpc_apply_to(mpc_many(lval_fold_cells, r->expr),
+                             lval_read_sexpr, a),
+                mpcf_dtor_null));
+
+        // Skips the blanks after tokens without copying them out, and lets
+        // expr pick its alternative from the next byte.
+        mpc_optimise(r->number);
+        mpc_optimise(r->symbol);
+        mpc_optimise(r->sexpr);
+        mpc_optimise(r->lispy);
 
-        if (strcmp(op, "+") == 0) return lval_new_num(x->num + y->num);
-        if (strcmp(op, "-") == 0) return lval_new_num(x->num - y->num);
-        if (strcmp(op, "*") == 0) return lval_new_num(x->num * y->num);
-        if (strcmp(op, "/") == 0) {
-                lval_t *result =
-                        y->num == 0 ?
-                        lval_new_err("division by zero") :
-                        lval_new_num(x->num / y->num);
-                return result;
+        return r;
+}
+
+static void
+reader_del(reader_t *r)
+{
+        mpc_cleanup(5, r->number, r->symbol, r->sexpr, r->expr, r->lispy);
+        free(r);
+}
+
+/* Bytecode compiler and VM
+ * -------------------------------------------------------------------------- */
+static chunk_t*
+chunk_new(void)
+{
+        chunk_t *c = malloc(sizeof(chunk_t));
+        c->code = NULL;
+        c->cnt = 0;
+        c->cap = 0;
+        c->depth = 0;
+        c->konst = NULL;
+        c->konst_cnt = 0;
+        c->stack = NULL;
+        return c;
+}
+
+static void
+chunk_del(chunk_t *c)
+{
+        free(c->konst);
+        free(c->code);
+        free(c->stack);
+        free(c);
+}
+
+static void
+chunk_emit(chunk_t *c, long word)
+{
+        if (c->cnt == c->cap) {
+                c->cap = c->cap ? c->cap * 2 : 16;
+                c->code = realloc(c->code, sizeof(long) * c->cap);
         }
 
-        return lval_new_err("unknown operator");
+        c->code[c->cnt++] = word;
 }
 
-static lval_t*
-lval_read(mpc_ast_t *tree)
+static int
+chunk_add_konst(chunk_t *c, lval_t *v)
+{
+        c->konst_cnt++;
+        c->konst = realloc(c->konst, sizeof(lval_t*) * c->konst_cnt);
+        c->konst[c->konst_cnt - 1] = v;
+        return c->konst_cnt - 1;
+}
+
+static int
+builtin_opcode(int atom)
+{
+        static const int builtin_opcodes[ATOM_BUILTIN_CNT] = {
+                [ATOM_ADD] = OP_ADD,
+                [ATOM_SUB] = OP_SUB,
+                [ATOM_MUL] = OP_MUL,
+                [ATOM_DIV] = OP_DIV
+        };
+
+        return atom < ATOM_BUILTIN_CNT ? builtin_opcodes[atom] : -1;
+}
+
+static int
+compile_raise(arena_t *a, chunk_t *c, char *msg)
 {
-        if (is_node_of_type(tree, "number")) {
-                return lval_read_num(tree);
+        chunk_emit(c, OP_CONST);
+        chunk_emit(c, chunk_add_konst(c, lval_new_err(a, msg)));
+        return KIND_RAISED;
+}
+
+// Emits code for a value that needs no frame: an atom or (), given that
+// depth values are already on the stack. Returns what the code leaves
+// behind; for KIND_CONST the value is stored in *konst and points into v.
+static int
+compile_leaf(chunk_t *c, lval_t *v, int depth, lval_t **konst)
+{
+        switch (lval_type(v)) {
+        case LVAL_NUM:
+                if (lval_is_fixnum(v)) {
+                        chunk_emit(c, OP_PUSH);
+                        chunk_emit(c, lval_fixnum(v));
+                } else {
+                        chunk_emit(c, OP_LOAD);
+                        chunk_emit(c, chunk_add_konst(c, v));
+                }
+                if (depth + 1 > c->depth) {
+                        c->depth = depth + 1;
+                }
+                return KIND_NUM;
+        case LVAL_ERR:
+                chunk_emit(c, OP_CONST);
+                chunk_emit(c, chunk_add_konst(c, v));
+                return KIND_RAISED;
         }
 
-        if (is_node_of_type(tree, "symbol")) {
-                return lval_new_sym(tree->contents);
+        *konst = v;
+        return KIND_CONST;
+}
+
+// Emits the operator call closing frame f, all of whose cells are compiled.
+static int
+compile_apply(arena_t *a, chunk_t *c, frame_t *f)
+{
+        if (f->op == NULL || lval_type(f->op) != LVAL_SYM) {
+                return compile_raise(a, c, "S-expression does not start with symbol");
         }
 
-        lval_t *sexpr = NULL;
+        int opcode = builtin_opcode(f->op->atom);
+        if (opcode < 0) {
+                return compile_raise(a, c, "unknown operator");
+        }
 
-        if ((is_node_of_type(tree, "sexpr")) || (is_node_root(tree))) {
-                sexpr = lval_new_sexpr();
+        if (!f->args_are_nums) {
+                return compile_raise(a, c, "cannot operate on non-number");
         }
 
-        for (int i = 0; i < tree->children_num; i++) {
-                mpc_ast_t *node = tree->children[i];
+        chunk_emit(c, opcode);
+        chunk_emit(c, f->argc);
+        return KIND_NUM;
+}
+
+// Emits code for v. Returns what the code leaves behind; for KIND_CONST
+// the value is stored in *konst and points into v.
+//
+// S-expressions are walked with an explicit stack of frames rather than by
+// recursion, so nesting depth is bounded by memory, not by the C stack.
+static int
+compile_expr(arena_t *a, chunk_t *c, lval_t *v, lval_t **konst)
+{
+        frames_t frames = { NULL, 0, 0 };
+        int depth = 0;
+        int kind;
+
+        for (;;) {
+                // (x) evaluates to x, so it takes no frame of its own.
+                while (lval_type(v) == LVAL_SEXPR && v->cnt == 1) {
+                        v = v->cell[0];
+                }
+
+                // Operands are evaluated left to right before the operator
+                // is applied, so that the first error raised is the
+                // leftmost one.
+                if (lval_type(v) == LVAL_SEXPR && v->cnt > 1) {
+                        frame_t *f = frames_push(&frames, v);
+                        f->depth = depth;
+                        v = v->cell[0];
+                        continue;
+                }
+
+                kind = compile_leaf(c, v, depth, konst);
+
+                // Hand the result to the frames waiting on it, until one of
+                // them has another cell to compile.
+                while (frames.cnt > 0) {
+                        frame_t *f = &frames.frame[frames.cnt - 1];
+
+                        if (kind == KIND_RAISED) {
+                                frames.cnt--;
+                                continue;
+                        }
 
-                if ((is_node_of_type(node, "number")) ||
-                    (is_node_of_type(node, "symbol")) ||
-                    (is_node_of_type(node, "sexpr"))) {
+                        if (f->i == 0) {
+                                if (kind == KIND_NUM) {
+                                        f->depth++;
+                                } else {
+                                        f->op = *konst;
+                                }
+                        } else if (kind == KIND_NUM) {
+                                f->argc++;
+                        } else {
+                                f->args_are_nums = false;
+                        }
 
-                        sexpr = lval_add_to_sexpr(sexpr, lval_read(node));
+                        if (++f->i < f->v->cnt) {
+                                break;
+                        }
+
+                        kind = compile_apply(a, c, f);
+                        frames.cnt--;
+                }
+
+                if (frames.cnt == 0) {
+                        break;
                 }
+
+                frame_t *f = &frames.frame[frames.cnt - 1];
+                v = f->v->cell[f->i];
+                depth = f->depth + f->argc;
         }
 
-        return sexpr;
+        free(frames.frame);
+        return kind;
 }
 
+static chunk_t*
+lval_compile(arena_t *a, lval_t *v)
+{
+        chunk_t *c = chunk_new();
+        lval_t *konst = NULL;
+
+        switch (compile_expr(a, c, v, &konst)) {
+        case KIND_NUM:
+                chunk_emit(c, OP_RET);
+                break;
+        case KIND_CONST:
+                chunk_emit(c, OP_CONST);
+                chunk_emit(c, chunk_add_konst(c, konst));
+                break;
+        case KIND_RAISED:
+                break;
+        }
+
+        c->stack = malloc(sizeof(lval_t*) * (c->depth > 0 ? c->depth : 1));
+        return c;
+}
+
+// Runs the chunk and returns its result, allocated from the arena. A chunk
+// can be run any number of times.
 static lval_t*
-lval_add_to_sexpr(lval_t *dst_node, lval_t *src_node)
+vm_run(arena_t *a, chunk_t *c)
 {
-        dst_node->cnt++;
-        dst_node->cell =
-                realloc(dst_node->cell, sizeof(lval_t*) * dst_node->cnt);
+        long *ip = c->code;
+        lval_t **sp = c->stack;
+        long argc;
+        lval_t *x;
 
-        dst_node->cell[dst_node->cnt - 1] = src_node;
-        return dst_node;
+        for (;;) {
+                switch (*ip++) {
+                case OP_PUSH:
+                        *sp++ = lval_new_fixnum(*ip++);
+                        break;
+                case OP_LOAD:
+                        *sp++ = c->konst[*ip++];
+                        break;
+                case OP_ADD:
+                        argc = *ip++;
+                        sp -= argc;
+                        x = sp[0];
+                        for (int i = 1; i < argc; i++) x = num_add(a, x, sp[i]);
+                        *sp++ = x;
+                        break;
+                case OP_SUB:
+                        argc = *ip++;
+                        sp -= argc;
+                        x = sp[0];
+                        for (int i = 1; i < argc; i++) x = num_sub(a, x, sp[i]);
+                        *sp++ = x;
+                        break;
+                case OP_MUL:
+                        argc = *ip++;
+                        sp -= argc;
+                        x = sp[0];
+                        for (int i = 1; i < argc; i++) x = num_mul(a, x, sp[i]);
+                        *sp++ = x;
+                        break;
+                case OP_DIV:
+                        argc = *ip++;
+                        sp -= argc;
+                        x = sp[0];
+                        for (int i = 1; i < argc; i++) {
+                                x = num_div(a, x, sp[i]);
+                                if (x == NULL) {
+                                        return lval_new_err(a, "division by zero");
+                                }
+                        }
+                        *sp++ = x;
+                        break;
+                case OP_CONST:
+                        return c->konst[*ip];
+                case OP_RET:
+                        return sp[-1];
+                default:
+                        return lval_new_err(a, "bad opcode");
+                }
+        }
 }
 
 static lval_t*
-eval (mpc_ast_t *tree)
+lval_eval(arena_t *a, lval_t *v)
+{
+        chunk_t *chunk = lval_compile(a, v);
+        lval_t *result = vm_run(a, chunk);
+        chunk_del(chunk);
+        return result;
+}
+
+// Everything from here on is left out when this file is built into the
+// benchmark harness, see bench.c.
+#ifndef LISPY_NO_MAIN
+
+/* Batch mode
+ * -------------------------------------------------------------------------- */
+// Makes room for and reads another block of input, dropping what has been
+// consumed already. Returns false at the end of the input.
+static bool
+source_fill(source_t *s)
 {
-        if (is_number_leaf(tree)) {
-                return lval_read_num(tree);
+        if (s->eof) {
+                return false;
         }
 
-        // Non-number nodes.
-        unsigned int i = 1;
-        mpc_ast_t *node = tree->children[i];
-        char *operator = node->contents;
+        if (s->start > 0) {
+                memmove(s->buf, s->buf + s->start, s->len - s->start);
+                s->len -= s->start;
+                s->start = 0;
+        }
 
-        node = tree->children[++i];
-        lval_t *x = eval(node);
+        if (s->cap - s->len < SOURCE_BLOCK_SIZE) {
+                s->cap = s->cap * 2 > s->len + SOURCE_BLOCK_SIZE ?
+                         s->cap * 2 : s->len + SOURCE_BLOCK_SIZE;
+                s->buf = realloc(s->buf, s->cap);
+        }
 
-        node = tree->children[++i];
-        while (is_expression_node(node)) {
-                lval_t *y = eval(node);
-                x = eval_op(x, operator, y);
-                node = tree->children[++i];
+        size_t n = fread(s->buf + s->len, 1, s->cap - s->len, s->file);
+        s->len += n;
+        if (n == 0) {
+                s->eof = true;
         }
 
-        return x;
+        return n > 0;
 }
 
-/* main
- * -------------------------------------------------------------------------- */
-int main(int argc, char** argv)
+// Advances past n bytes of the buffer, keeping track of where they end in
+// the input.
+static void
+source_consume(source_t *s, size_t n)
+{
+        const char *p = s->buf + s->start;
+        const char *end = p + n;
+        const char *nl;
+
+        s->col += n;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+                s->row++;
+                s->col = end - nl - 1;
+                p = nl + 1;
+        }
+
+        s->pos += n;
+        s->start += n;
+}
+
+// Returns the offset just past the parenthesis closing the one at buf[i],
+// or 0 if it is not closed within len bytes. Where SSE2 is available, the
+// parentheses of 16 bytes are found at once, and a block with fewer closing
+// ones than are open is skipped without looking at them in turn.
+static size_t
+form_end(const char *buf, size_t i, size_t len)
+{
+        int depth = 0;
+
+#if defined(__SSE2__)
+        const __m128i open = _mm_set1_epi8('(');
+        const __m128i close = _mm_set1_epi8(')');
+
+        for (; i + 16 <= len; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+                unsigned o = _mm_movemask_epi8(_mm_cmpeq_epi8(v, open));
+                unsigned c = _mm_movemask_epi8(_mm_cmpeq_epi8(v, close));
+
+                if (depth > __builtin_popcount(c)) {
+                        depth += __builtin_popcount(o) - __builtin_popcount(c);
+                        continue;
+                }
+
+                for (unsigned m = o | c; m != 0; m &= m - 1) {
+                        int b = __builtin_ctz(m);
+                        if (o & (1u << b)) {
+                                depth++;
+                        } else if (--depth == 0) {
+                                return i + b + 1;
+                        }
+                }
+        }
+#endif
+
+        for (; i < len; i++) {
+                if (buf[i] == '(') {
+                        depth++;
+                } else if (buf[i] == ')' && --depth == 0) {
+                        return i + 1;
+                }
+        }
+
+        return 0;
+}
+
+// Finds the top-level forms in the unconsumed part of the buffer, storing
+// them in *forms, grown as needed, and returns how many there are. A form
+// still running at the end of the buffer is left for a later call, once
+// more has been read, unless the input has ended: then it is handed over
+// as is, for the reader to report. Forms are delimited by parentheses and
+// whitespace alone.
+static int
+source_split(source_t *s, form_t **forms, int *cap)
+{
+        int cnt = 0;
+        size_t i = s->start;
+
+        for (;;) {
+                while (i < s->len && isspace((unsigned char)s->buf[i])) {
+                        i++;
+                }
+                if (i == s->len) {
+                        break;
+                }
+
+                char c = s->buf[i];
+                size_t end = i + 1;
+                bool done = true;
+
+                if (c == '(') {
+                        end = form_end(s->buf, i, s->len);
+                        done = end != 0;
+                } else if (c != ')') {
+                        while (end < s->len &&
+                               !isspace((unsigned char)s->buf[end]) &&
+                               s->buf[end] != '(' && s->buf[end] != ')') {
+                                end++;
+                        }
+                        done = end < s->len;
+                }
+
+                if (!done) {
+                        if (!s->eof) {
+                                break;
+                        }
+                        end = s->len;
+                }
+
+                if (cnt == *cap) {
+                        *cap = *cap ? *cap * 2 : 256;
+                        *forms = realloc(*forms, sizeof(form_t) * *cap);
+                }
+                (*forms)[cnt].off = i;
+                (*forms)[cnt].len = end - i;
+                cnt++;
+                i = end;
+        }
+
+        return cnt;
+}
+
+static pool_t*
+pool_new(int cnt)
+{
+        pool_t *p = malloc(sizeof(pool_t));
+        p->cnt = cnt;
+        p->readers = malloc(sizeof(reader_t*) * cnt);
+        p->arenas = malloc(sizeof(arena_t*) * cnt);
+
+        for (int i = 0; i < cnt; i++) {
+                p->arenas[i] = arena_new();
+                p->readers[i] = reader_new(p->arenas[i]);
+        }
+
+        return p;
+}
+
+static void
+pool_del(pool_t *p)
+{
+        for (int i = 0; i < p->cnt; i++) {
+                reader_del(p->readers[i]);
+                arena_del(p->arenas[i]);
+        }
+        free(p->readers);
+        free(p->arenas);
+        free(p);
+}
+
+static void*
+job_run(void *arg)
+{
+        job_t *j = arg;
+
+        for (int i = 0; i < j->cnt; i++) {
+                form_t *f = &j->form[i];
+                f->ok = mpc_nparse(j->name, j->buf + f->off, f->len,
+                                   j->reader->lispy, &f->res);
+        }
+        return NULL;
+}
+
+// Reads the forms of a batch, each thread a run of them of about the same
+// number of bytes. The calling thread takes the first run, and any that a
+// thread could not be started for.
+static void
+pool_read(pool_t *p, const char *name, const char *buf, form_t *forms,
+          int cnt)
 {
-        // Create parsers.
-        mpc_parser_t* Number   = mpc_new("number");
-        mpc_parser_t* Symbol   = mpc_new("symbol");
-        mpc_parser_t* Sexpr    = mpc_new("sexpr");
-        mpc_parser_t* Expr     = mpc_new("expr");
-        mpc_parser_t* Lispy    = mpc_new("lispy");
-
-        // Define parsers with the following language.
-        mpca_lang(MPCA_LANG_DEFAULT,
-                  "number   :   /-?[0-9]+/ ;"
-                  "symbol   :   '+' | '-' | '*' | '/' ;"
-                  "sexpr    :   '(' <expr>* ')' ;"
-                  "expr     :   <number> | <symbol> | <sexpr> ;"
-                  "lispy    :   /^/ <expr>* /$/ ;"
-                  ,
-                  Number, Symbol, Sexpr, Expr, Lispy);
+        job_t *job = malloc(sizeof(job_t) * p->cnt);
+        size_t first = forms[0].off;
+        size_t total = forms[cnt - 1].off + forms[cnt - 1].len - first;
+        int i = 0;
+
+        for (int k = 0; k < p->cnt; k++) {
+                size_t limit = first + total / p->cnt * (k + 1);
+                job[k] = (job_t) { .reader = p->readers[k], .name = name,
+                                   .buf = buf, .form = &forms[i] };
+                while (i < cnt && (k == p->cnt - 1 || forms[i].off < limit)) {
+                        job[k].cnt++;
+                        i++;
+                }
+        }
+
+        for (int k = 1; k < p->cnt; k++) {
+                job[k].started = job[k].cnt > 0 &&
+                        pthread_create(&job[k].thread, NULL, job_run,
+                                       &job[k]) == 0;
+        }
+
+        for (int k = 0; k < p->cnt; k++) {
+                if (k == 0 || !job[k].started) {
+                        job_run(&job[k]);
+                }
+        }
+
+        for (int k = 1; k < p->cnt; k++) {
+                if (job[k].started) {
+                        pthread_join(job[k].thread, NULL);
+                }
+        }
+
+        free(job);
+}
+
+// Reads, evaluates and prints each top-level form of a file in turn, or
+// of stdin if name is "-". Returns nonzero if the file could not be read.
+// Forms are read a batch at a time, on all the threads of p at once, and
+// evaluated in order once the whole batch has been read.
+static int
+run_file(pool_t *p, arena_t *a, const char *name)
+{
+        source_t s = { 0 };
+        s.name = name;
+        s.file = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+        if (s.file == NULL) {
+                fprintf(stderr, "%s: %s\n", name, strerror(errno));
+                return 1;
+        }
+
+        form_t *forms = NULL;
+        int cap = 0;
+        size_t batch = (size_t)SOURCE_BATCH_SIZE * p->cnt;
+
+        for (;;) {
+                while (s.len - s.start < batch && source_fill(&s)) {
+                }
+
+                int cnt = source_split(&s, &forms, &cap);
+                if (cnt == 0) {
+                        // Only the start of a form longer than a batch, or
+                        // nothing at all, is left.
+                        if (s.eof) {
+                                break;
+                        }
+                        source_fill(&s);
+                        continue;
+                }
+
+                pool_read(p, name, s.buf, forms, cnt);
+
+                for (int i = 0; i < cnt; i++) {
+                        form_t *f = &forms[i];
+                        source_consume(&s, f->off - s.start);
+
+                        if (f->ok) {
+                                lval_print(lval_eval(a, f->res.output));
+                                putchar('\n');
+                        } else {
+                                // Errors are located within the form; make
+                                // that within the file.
+                                mpc_err_t *err = f->res.error;
+                                if (err->state.row == 0) {
+                                        err->state.col += s.col;
+                                }
+                                err->state.row += s.row;
+                                err->state.pos += s.pos;
+                                mpc_err_print(err);
+                                mpc_err_delete(err);
+                        }
 
+                        arena_reset(a);
+                        source_consume(&s, f->len);
+                }
+
+                for (int i = 0; i < p->cnt; i++) {
+                        arena_reset(p->arenas[i]);
+                }
+        }
+
+        int status = ferror(s.file) ? 1 : 0;
+        if (status) {
+                fprintf(stderr, "%s: read error\n", name);
+        }
+
+        free(forms);
+        free(s.buf);
+        if (s.file != stdin) {
+                fclose(s.file);
+        }
+        return status;
+}
+
+static void
+run_repl(reader_t *r, arena_t *a)
+{
         puts("Lispy version 0.5.0");
         puts("Press Ctrl+C to exit\n");
 
-        while (1) {
+        // An expression may run over several lines; each line is fed to
+        // the reader until it has all of one.
+        mpc_parse_ctx_t *ctx = mpc_parse_ctx_new("<stdin>", r->lispy,
+                                                 mpcf_dtor_null);
+        const char *prompt = "> ";
+        char *usr_input;
 
-                char *usr_input = readline("> ");
+        while ((usr_input = readline(prompt)) != NULL) {
                 add_history(usr_input);
 
-                mpc_result_t r;
-                // Attempt to parse the user input.
-                if (mpc_parse("<stdin>", usr_input, Lispy, &r)) {
-                        // Parsing successful.
-                        mpc_ast_t *ast = r.output;
-                        lval_t *x = lval_read(ast);
-                        lval_println(x);
-                        lval_del(x);
-                        //lval_t *expr_result = eval(ast);
-                        //lval_println(expr_result);
-                        mpc_ast_delete(ast);
-                } else {
-                        mpc_err_print(r.error);
-                        mpc_err_delete(r.error);
+                // Put back the newline readline strips, as it separates
+                // this line's last token from the next line's first.
+                size_t n = strlen(usr_input);
+                usr_input = realloc(usr_input, n + 2);
+                usr_input[n] = '\n';
+                usr_input[n + 1] = '\0';
+
+                mpc_result_t res;
+                int status = mpc_parse_feed(ctx, usr_input, n + 1, &res);
+                if (status == MPC_PARSE_READY) {
+                        status = mpc_parse_finish(ctx, &res);
+                }
+
+                if (status == MPC_PARSE_DONE) {
+                        lval_println(lval_eval(a, res.output));
+                } else if (status == MPC_PARSE_ERROR) {
+                        mpc_err_print(res.error);
+                        mpc_err_delete(res.error);
                 }
+                prompt = status == MPC_PARSE_MORE ? "  " : "> ";
 
+                // Everything read and evaluated lives in the arena, and
+                // is released in one go. An expression still to be
+                // completed has its parts read so far held by ctx, so
+                // they stay until it is done.
+                if (status != MPC_PARSE_MORE) {
+                        arena_reset(a);
+                }
                 free(usr_input);
         }
 
-        mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispy);
+        mpc_parse_ctx_delete(ctx);
+}
 
-        return 0;
+/* main
+ * -------------------------------------------------------------------------- */
+// With no arguments, runs an interactive REPL. Otherwise runs each of the
+// files given in batch mode, "-" standing for stdin.
+int main(int argc, char** argv)
+{
+        symtab_init();
+
+        arena_t *arena = arena_new();
+        int status = 0;
+
+        if (argc > 1) {
+                // Files are read with a reader per online CPU.
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                pool_t *pool = pool_new(cpus > 0 ? cpus : 1);
+                for (int i = 1; i < argc; i++) {
+                        status |= run_file(pool, arena, argv[i]);
+                }
+                pool_del(pool);
+        } else {
+                reader_t *reader = reader_new(arena);
+                run_repl(reader, arena);
+                reader_del(reader);
+        }
+
+        arena_del(arena);
+        symtab_del();
+
+        return status;
 }
+#endif // LISPY_NO_MAIN
@@ -0,0 +1,393 @@
+// Checks of what is hard to see by hand in the reader and the numbers:
+// nesting far beyond what the C stack would take, input fed in pieces,
+// batch parsing and bignums at the edge of the fixnum range. Run it with
+// `make test`. It prints each failure, and exits non-zero if any failed.
+#define _POSIX_C_SOURCE 200809L
+#define LISPY_NO_MAIN
+
+#include <unistd.h>
+#include "parsing.c"
+
+/* Private routine prototypes
+ * -------------------------------------------------------------------------- */
+static void check(const char *what, const char *want, const char *got);
+static char* read_back(FILE *f);
+static char* print_lval(lval_t *v);
+static char* eval_str(reader_t *r, arena_t *a, const char *src);
+static char* show_result(bool ok, mpc_result_t *r);
+static char* feed(reader_t *r, const char *s, size_t first, size_t step);
+static void check_deep(reader_t *r, arena_t *a);
+static void check_split(reader_t *r, arena_t *a);
+static char* show_ast(bool ok, mpc_result_t *r);
+static void check_batch(void);
+static void check_bignums(reader_t *r, arena_t *a);
+
+static int failures = 0;
+
+/* Helpers
+ * -------------------------------------------------------------------------- */
+static void
+check(const char *what, const char *want, const char *got)
+{
+        if (strcmp(want, got) == 0) {
+                return;
+        }
+
+        printf("FAIL %s\n  want: %s\n  got:  %s\n", what, want, got);
+        failures++;
+}
+
+// Returns everything written to f, which is closed.
+static char*
+read_back(FILE *f)
+{
+        fseek(f, 0, SEEK_END);
+        long n = ftell(f);
+        char *s = malloc(n + 1);
+
+        rewind(f);
+        s[fread(s, 1, n, f)] = '\0';
+        fclose(f);
+        return s;
+}
+
+// Returns v as the REPL prints it, less the space before and the newline
+// after.
+static char*
+print_lval(lval_t *v)
+{
+        FILE *f = tmpfile();
+        int out = dup(STDOUT_FILENO);
+
+        fflush(stdout);
+        dup2(fileno(f), STDOUT_FILENO);
+        lval_println(v);
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+        close(out);
+
+        char *s = read_back(f);
+        size_t n = strlen(s);
+        memmove(s, s + 1, n - 1);
+        s[n - 2] = '\0';
+        return s;
+}
+
+// Reads and evaluates src, and returns the result as printed.
+static char*
+eval_str(reader_t *r, arena_t *a, const char *src)
+{
+        mpc_result_t res;
+        char *s;
+
+        arena_reset(a);
+        if (!mpc_parse("<test>", src, r->lispy, &res)) {
+                s = mpc_err_string(res.error);
+                mpc_err_delete(res.error);
+                return s;
+        }
+
+        s = print_lval(lval_eval(a, res.output));
+        arena_reset(a);
+        return s;
+}
+
+// Returns a value read as printed, or the error.
+static char*
+show_result(bool ok, mpc_result_t *r)
+{
+        if (ok) {
+                return print_lval(r->output);
+        }
+
+        char *s = mpc_err_string(r->error);
+        mpc_err_delete(r->error);
+        return s;
+}
+
+// Feeds s to the reader in a first piece of first bytes, then in pieces
+// of step bytes, and returns what it reads, as show_result() does.
+static char*
+feed(reader_t *r, const char *s, size_t first, size_t step)
+{
+        mpc_parse_ctx_t *ctx = mpc_parse_ctx_new("<test>", r->lispy,
+                                                 mpcf_dtor_null);
+        size_t len = strlen(s);
+        size_t at = 0;
+        size_t n = first;
+        mpc_result_t res;
+        int status;
+
+        do {
+                if (n > len - at) {
+                        n = len - at;
+                }
+                status = mpc_parse_feed(ctx, s + at, n, &res);
+                at += n;
+                n = step;
+        } while (at < len &&
+                 (status == MPC_PARSE_MORE || status == MPC_PARSE_READY));
+
+        if (status == MPC_PARSE_MORE || status == MPC_PARSE_READY) {
+                status = mpc_parse_finish(ctx, &res);
+        }
+
+        char *got = show_result(status == MPC_PARSE_DONE, &res);
+        mpc_parse_ctx_delete(ctx);
+        return got;
+}
+
+// As show_result(), for parsers that build an mpc_ast_t.
+static char*
+show_ast(bool ok, mpc_result_t *r)
+{
+        if (!ok) {
+                return show_result(ok, r);
+        }
+
+        FILE *f = tmpfile();
+        mpc_ast_print_to(r->output, f);
+        mpc_ast_delete(r->output);
+        return read_back(f);
+}
+
+/* Checks
+ * -------------------------------------------------------------------------- */
+// Parsers once recursed on the C stack for every level of nesting, and
+// ran out of it a few tens of thousands of levels in.
+static void
+check_deep(reader_t *r, arena_t *a)
+{
+        enum { DEPTH = 300000 };
+        char *s = malloc(DEPTH * 6 + 2);
+        char want[32];
+        size_t len = 0;
+
+        for (int i = 0; i < DEPTH; i++) {
+                memcpy(s + len, "(+ 1 ", 5);
+                len += 5;
+        }
+        s[len++] = '0';
+        memset(s + len, ')', DEPTH);
+        len += DEPTH;
+        s[len] = '\0';
+
+        snprintf(want, sizeof(want), "%d", DEPTH);
+        char *got = eval_str(r, a, s);
+        check("deep nesting", want, got);
+
+        free(got);
+        free(s);
+}
+
+// A form fed in two pieces, split at every byte, or a byte at a time,
+// must read as it does when parsed whole. A feed that has all of a form
+// says it is READY, and one that has part of it asks for MORE.
+static void
+check_split(reader_t *r, arena_t *a)
+{
+        static const char *forms[] = {
+                "(+ 1 (* 2 3) -4)",
+                "  (- 12\n  (/ 99999999999999999999 3))\n",
+                "(+ 1 2) (* 3 4)",
+                "(+ 1",
+                "(* 2 3))",
+                "(+ 1 x)",
+                "-",
+                ""
+        };
+        char what[64];
+
+        for (size_t i = 0; i < sizeof(forms) / sizeof(forms[0]); i++) {
+                const char *s = forms[i];
+                size_t len = strlen(s);
+                mpc_result_t res;
+
+                arena_reset(a);
+                bool ok = mpc_parse("<test>", s, r->lispy, &res);
+                char *want = show_result(ok, &res);
+
+                for (size_t cut = 0; cut <= len; cut++) {
+                        arena_reset(a);
+                        char *got = feed(r, s, cut, len);
+                        snprintf(what, sizeof(what),
+                                 "form %zu split at %zu", i, cut);
+                        check(what, want, got);
+                        free(got);
+                }
+
+                arena_reset(a);
+                char *got = feed(r, s, 1, 1);
+                snprintf(what, sizeof(what), "form %zu a byte at a time", i);
+                check(what, want, got);
+                free(got);
+                free(want);
+        }
+
+        static const struct {
+                const char *s;
+                int status;
+                const char *name;
+        } statuses[] = {
+                { "(+ 1 2)\n", MPC_PARSE_READY, "READY" },
+                { "(+ 1", MPC_PARSE_MORE, "MORE" },
+                { "1 2)", MPC_PARSE_ERROR, "ERROR" }
+        };
+
+        for (size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+                mpc_parse_ctx_t *ctx = mpc_parse_ctx_new("<test>", r->lispy,
+                                                         mpcf_dtor_null);
+                mpc_result_t res;
+                const char *s = statuses[i].s;
+                int status = mpc_parse_feed(ctx, s, strlen(s), &res);
+
+                if (status == MPC_PARSE_ERROR) {
+                        mpc_err_delete(res.error);
+                }
+                snprintf(what, sizeof(what), "status after feeding %zu", i);
+                check(what, statuses[i].name,
+                      status == MPC_PARSE_READY ? "READY" :
+                      status == MPC_PARSE_MORE ? "MORE" :
+                      status == MPC_PARSE_ERROR ? "ERROR" : "DONE");
+                mpc_parse_ctx_delete(ctx);
+        }
+
+        arena_reset(a);
+}
+
+// Strings parsed together on several threads must give what they give
+// parsed one by one, with the grammar as written and once optimised.
+// The reader's callbacks share an arena, so this grammar builds ASTs.
+static void
+check_batch(void)
+{
+        enum { COUNT = 500, THREADS = 4 };
+        mpc_parser_t *number = mpc_new("number");
+        mpc_parser_t *symbol = mpc_new("symbol");
+        mpc_parser_t *sexpr = mpc_new("sexpr");
+        mpc_parser_t *expr = mpc_new("expr");
+        mpc_parser_t *lispy = mpc_new("lispy");
+        mpc_err_t *err = mpca_lang(MPCA_LANG_DEFAULT,
+                " number : /-?[0-9]+/ ;                   "
+                " symbol : '+' | '-' | '*' | '/' ;        "
+                " sexpr  : '(' <expr>* ')' ;              "
+                " expr   : <number> | <symbol> | <sexpr> ;"
+                " lispy  : /^/ <expr>* /$/ ;              ",
+                number, symbol, sexpr, expr, lispy, NULL);
+        if (err != NULL) {
+                mpc_err_print(err);
+                mpc_err_delete(err);
+                failures++;
+                return;
+        }
+
+        static const char *parts[] = {
+                "(+ 1 2)", "(* (- 3 4) 5)", "-6", "(/ 7", "8)", "(+ x)", " "
+        };
+        int nparts = sizeof(parts) / sizeof(parts[0]);
+        const char *strings[COUNT];
+        mpc_result_t results[COUNT];
+        int oks[COUNT];
+        char what[64];
+
+        for (int i = 0; i < COUNT; i++) {
+                char *s = malloc(64);
+                snprintf(s, 64, "%s %s%s", parts[i % nparts],
+                         parts[i / nparts % nparts], i % 3 ? "" : "\n");
+                strings[i] = s;
+        }
+
+        for (int pass = 0; pass < 2; pass++) {
+                mpc_parse_batch("<batch>", strings, COUNT, lispy,
+                                results, oks, THREADS);
+
+                for (int i = 0; i < COUNT; i++) {
+                        mpc_result_t res;
+                        bool ok = mpc_parse("<batch>", strings[i], lispy, &res);
+                        char *want = show_ast(ok, &res);
+                        char *got = show_ast(oks[i], &results[i]);
+
+                        snprintf(what, sizeof(what), "batch pass %d, string %d",
+                                 pass, i);
+                        check(what, want, got);
+                        free(want);
+                        free(got);
+                }
+
+                mpc_optimise(lispy);
+        }
+
+        for (int i = 0; i < COUNT; i++) {
+                free((char*)strings[i]);
+        }
+        mpc_cleanup(5, number, symbol, sexpr, expr, lispy);
+}
+
+// Arithmetic across the edge of the fixnum range, where results are
+// promoted to bignums or come back, against values worked out by hand.
+static void
+check_bignums(reader_t *r, arena_t *a)
+{
+        static const struct {
+                const char *src;
+                const char *want;
+        } cases[] = {
+#if INTPTR_MAX == INT64_MAX
+                { "(+ 4611686018427387903 1)", "4611686018427387904" },
+                { "(- 4611686018427387904 1)", "4611686018427387903" },
+                { "(- -4611686018427387904 1)", "-4611686018427387905" },
+                { "(+ -4611686018427387905 1)", "-4611686018427387904" },
+                { "(* 4611686018427387903 2)", "9223372036854775806" },
+                { "(* -4611686018427387904 -1)", "4611686018427387904" },
+                { "(/ -4611686018427387904 -1)", "4611686018427387904" },
+                { "(+ 9223372036854775807 1)", "9223372036854775808" },
+                { "(- 9223372036854775808 9223372036854775807)", "1" },
+                { "(* 4611686018427387904 4611686018427387904)",
+                  "21267647932558653966460912964485513216" },
+                { "(/ 21267647932558653966460912964485513216 "
+                  "4611686018427387904)", "4611686018427387904" },
+#else
+                { "(+ 1073741823 1)", "1073741824" },
+                { "(- 1073741824 1)", "1073741823" },
+                { "(- -1073741824 1)", "-1073741825" },
+                { "(+ -1073741825 1)", "-1073741824" },
+                { "(* 1073741823 2)", "2147483646" },
+                { "(* -1073741824 -1)", "1073741824" },
+                { "(/ -1073741824 -1)", "1073741824" },
+                { "(* 1073741824 1073741824)", "1152921504606846976" },
+                { "(/ 1152921504606846976 1073741824)", "1073741824" },
+#endif
+                { "(* 99999999999999999999 99999999999999999999)",
+                  "9999999999999999999800000000000000000001" },
+                { "(- 100000000000000000000 1)", "99999999999999999999" },
+                { "(/ 99999999999999999999 0)", "Error: division by zero" }
+        };
+
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+                char *got = eval_str(r, a, cases[i].src);
+                check(cases[i].src, cases[i].want, got);
+                free(got);
+        }
+}
+
+/* main
+ * -------------------------------------------------------------------------- */
+int main(void)
+{
+        symtab_init();
+
+        arena_t *arena = arena_new();
+        reader_t *reader = reader_new(arena);
+
+        check_deep(reader, arena);
+        check_split(reader, arena);
+        check_batch();
+        check_bignums(reader, arena);
+
+        reader_del(reader);
+        arena_del(arena);
+        symtab_del();
+
+        printf("%s: %d failed\n", failures ? "FAIL" : "ok", failures);
+        return failures ? 1 : 0;
+}